@@ -0,0 +1,291 @@
+#include "audio_transcoder.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const unsigned int INPUT_SAMPLE_RATE = 8000;
+const unsigned int OUTPUT_SAMPLE_RATE = 44100;
+const unsigned int CHANNELS = 1;
+
+// Larger camera packets are resampled in chunks so the FIFO has a fixed size
+const int MAX_INPUT_SAMPLES = 4096;
+
+// Encoded MP3 frames are well under this at any bit rate the encoder uses
+const size_t MAX_ENCODED_FRAME_SIZE = 4096;
+
+// About 7 seconds of MP3 frames
+const size_t PACKET_RING_CAPACITY = 256;
+
+// Packets transcoded before the task yields its worker
+const size_t PACKETS_PER_RUN = 32;
+
+// Input further than this from the sample count re-anchors the timestamps.
+// Well above network jitter, and above the remux resync threshold so the
+// jump restarts its audio decode time.
+const std::chrono::milliseconds CLOCK_RESYNC_THRESHOLD(500);
+
+struct CAVPacket : public AVPacket {
+  CAVPacket() {
+    av_init_packet(this);
+    data = nullptr;
+    size = 0;
+  }
+
+  ~CAVPacket() {
+    av_packet_unref(this);
+  }
+};
+
+std::chrono::microseconds SamplesDuration(int64_t samples, int sample_rate) {
+  return std::chrono::microseconds(samples * 1000000LL / sample_rate);
+}
+
+}  // namespace
+
+namespace foscam_hd {
+
+AudioTranscoderException::AudioTranscoderException(const std::string & what)
+    : what_("AudioTranscoderException: " + what) {
+}
+
+const char* AudioTranscoderException::what() const noexcept {
+  return what_.c_str();
+}
+
+AudioTranscoder::Registrator::Registrator() {
+  avcodec_register_all();
+}
+
+AudioTranscoder::AudioTranscoder(WorkerPool & worker_pool,
+                                 BroadcastRing & pcm_ring,
+                                 const BufferLimits & input_limits,
+                                 Resampler resampler)
+    : input_reader_(pcm_ring),
+      packets_(PACKET_RING_CAPACITY),
+      packet_pool_(std::make_shared<PacketPool>()),
+      encoder_(nullptr),
+      audio_resampler_(nullptr),
+      fifo_size_(0),
+      next_pts_(0),
+      input_task_(worker_pool, [this]() { InputReady(); }) {
+  static_assert(CameraPcmResampler::UP * INPUT_SAMPLE_RATE ==
+                CameraPcmResampler::DOWN * OUTPUT_SAMPLE_RATE,
+                "Native resampler does not match the audio rates");
+  if (resampler == Resampler::NATIVE) {
+    native_resampler_.reset(new CameraPcmResampler());
+  }
+
+  try {
+    OpenCodecs();
+  } catch (std::exception & ex) {
+    Release();
+    throw;
+  }
+
+  input_reader_.set_limits(input_limits);
+  input_reader_.set_notifier(&input_task_.notifier());
+}
+
+AudioTranscoder::~AudioTranscoder() {
+  input_task_.Stop();
+  input_reader_.set_notifier(nullptr);
+  Release();
+}
+
+auto AudioTranscoder::config() const -> const Config & {
+  return config_;
+}
+
+BroadcastRing & AudioTranscoder::packets() {
+  return packets_;
+}
+
+DropStats AudioTranscoder::input_drop_stats() const {
+  return input_reader_.drop_stats();
+}
+
+void AudioTranscoder::OpenCodecs() {
+  AVCodec * encoder = avcodec_find_encoder(AV_CODEC_ID_MP3);
+  if (!encoder) {
+    throw AudioTranscoderException("Failed to find MP3 encoder");
+  }
+  encoder_ = avcodec_alloc_context3(encoder);
+  if (!encoder_) {
+    throw AudioTranscoderException("Failed to allocate encoder");
+  }
+  encoder_->sample_rate = OUTPUT_SAMPLE_RATE;
+  encoder_->sample_fmt = AV_SAMPLE_FMT_S16;
+  encoder_->channels = CHANNELS;
+  encoder_->channel_layout = av_get_default_channel_layout(CHANNELS);
+  encoder_->time_base.num = 1;
+  encoder_->time_base.den = OUTPUT_SAMPLE_RATE;
+  auto ret = avcodec_open2(encoder_, encoder, nullptr);
+  if (ret < 0) {
+    throw AudioTranscoderException("Failed to open encoder");
+  }
+
+  // The camera always sends 8 kHz mono s16le, which is the host's s16, so
+  // the packets are resampled as they are with no decoder
+  static_assert(CHANNELS == 1, "Native resampler is mono only");
+  int max_resampled = CameraPcmResampler::max_output(MAX_INPUT_SAMPLES);
+  if (!native_resampler_) {
+    audio_resampler_ = swr_alloc_set_opts(
+        nullptr, encoder_->channel_layout, encoder_->sample_fmt,
+        encoder_->sample_rate, encoder_->channel_layout, AV_SAMPLE_FMT_S16,
+        INPUT_SAMPLE_RATE, 0, nullptr);
+    if (audio_resampler_ == nullptr) {
+      throw AudioTranscoderException("Failed to allocate resampler");
+    }
+
+    ret = swr_init(audio_resampler_);
+    if (ret < 0) {
+      throw AudioTranscoderException("Failed to initialize resampler");
+    }
+    max_resampled = std::max(max_resampled,
+                             swr_get_out_samples(audio_resampler_,
+                                                 MAX_INPUT_SAMPLES));
+  }
+
+  // Room for a partial frame plus the resampled largest input chunk
+  fifo_.resize((encoder_->frame_size + max_resampled) * CHANNELS);
+
+  // Points into the FIFO for each encode, never owns samples
+  frame_.reset(av_frame_alloc());
+  if (frame_ == nullptr) {
+    throw AudioTranscoderException("Failed to allocate frame");
+  }
+  frame_->nb_samples = encoder_->frame_size;
+  frame_->channel_layout = encoder_->channel_layout;
+  frame_->format = encoder_->sample_fmt;
+  frame_->sample_rate = encoder_->sample_rate;
+  frame_->linesize[0] = encoder_->frame_size * CHANNELS * sizeof(int16_t);
+
+  config_.sample_rate = encoder_->sample_rate;
+  config_.channels = encoder_->channels;
+  config_.frame_size = encoder_->frame_size;
+  config_.bit_rate = encoder_->bit_rate;
+}
+
+void AudioTranscoder::Release() {
+  frame_.reset();
+  swr_free(&audio_resampler_);
+  avcodec_free_context(&encoder_);
+}
+
+void AudioTranscoder::InputReady() {
+  for (size_t count = 0; count < PACKETS_PER_RUN; count++) {
+    MediaPacketPtr packet = input_reader_.try_read_packet();
+    if (!packet) {
+      return;
+    }
+    TranscodeAudioPacket(*packet);
+  }
+
+  // More may be queued, let other tasks run first
+  input_task_.Schedule();
+}
+
+void AudioTranscoder::TranscodeAudioPacket(const MediaPacket & pcm_packet) {
+  const uint8_t * input = pcm_packet.data.data();
+  int input_samples = pcm_packet.data.size() / (CHANNELS * sizeof(int16_t));
+  while (input_samples > 0) {
+    int count = std::min(input_samples, MAX_INPUT_SAMPLES);
+    int converted = Resample(reinterpret_cast<const int16_t *>(input), count,
+                             fifo_.data() + fifo_size_,
+                             (fifo_.size() - fifo_size_) / CHANNELS);
+    if (converted < 0) {
+      throw AudioTranscoderException("Failed to convert input samples");
+    }
+
+    fifo_size_ += converted * CHANNELS;
+    input += count * CHANNELS * sizeof(int16_t);
+    input_samples -= count;
+    EncodeAvailableFrames(pcm_packet.timestamp);
+  }
+}
+
+int AudioTranscoder::Resample(const int16_t * input, int count,
+                              int16_t * output, int capacity) {
+  if (native_resampler_) {
+    return native_resampler_->Process(input, count, output);
+  }
+
+  auto swr_input = reinterpret_cast<const uint8_t *>(input);
+  auto swr_output = reinterpret_cast<uint8_t *>(output);
+  return swr_convert(audio_resampler_, &swr_output, capacity, &swr_input,
+                     count);
+}
+
+void AudioTranscoder::EncodeAvailableFrames(
+    std::chrono::steady_clock::time_point arrival) {
+  size_t frame_samples = encoder_->frame_size * CHANNELS;
+  size_t offset = 0;
+  while (fifo_size_ - offset >= frame_samples) {
+    // The packet's last sample arrived with it, date the frame's first one
+    // back
+    auto first_sample_time = arrival - SamplesDuration(
+        (fifo_size_ - offset) / CHANNELS, encoder_->sample_rate);
+    if (clock_anchors_.empty()) {
+      clock_anchors_.push_back(ClockAnchor{next_pts_, first_sample_time});
+    } else {
+      const ClockAnchor & anchor = clock_anchors_.back();
+      auto counted_time = anchor.time + SamplesDuration(
+          next_pts_ - anchor.pts, encoder_->sample_rate);
+      if (first_sample_time > counted_time + CLOCK_RESYNC_THRESHOLD ||
+          first_sample_time + CLOCK_RESYNC_THRESHOLD < counted_time) {
+        clock_anchors_.push_back(ClockAnchor{next_pts_, first_sample_time});
+      }
+    }
+
+    frame_->data[0] = reinterpret_cast<uint8_t *>(fifo_.data() + offset);
+    frame_->pts = next_pts_;
+    next_pts_ += encoder_->frame_size;
+    EncodeFrame(frame_.get());
+    offset += frame_samples;
+  }
+
+  // Less than a frame is left, move it to the front for the next packet
+  if (offset > 0) {
+    fifo_size_ -= offset;
+    memmove(fifo_.data(), fifo_.data() + offset,
+            fifo_size_ * sizeof(int16_t));
+  }
+}
+
+void AudioTranscoder::EncodeFrame(AVFrame * frame) {
+  // Encode straight into a pooled packet; the encoder takes a caller
+  // supplied buffer when it is large enough
+  auto packet = packet_pool_->Acquire(MAX_ENCODED_FRAME_SIZE);
+  CAVPacket encoded_packet;
+  encoded_packet.data = packet->data.data();
+  encoded_packet.size = packet->data.size();
+  int got_packet = 0;
+  auto ret = avcodec_encode_audio2(encoder_, &encoded_packet, frame,
+                                   &got_packet);
+  if (ret < 0) {
+    throw AudioTranscoderException("Failed to encode frame");
+  }
+  if (!got_packet) {
+    return;
+  }
+
+  int64_t pts = encoded_packet.pts != AV_NOPTS_VALUE ? encoded_packet.pts :
+      frame->pts;
+  packet->data.resize(encoded_packet.size);
+  if (encoded_packet.data != packet->data.data()) {
+    memcpy(packet->data.data(), encoded_packet.data, encoded_packet.size);
+  }
+  // The encoder delays its output, older anchors may still be in use
+  while (clock_anchors_.size() > 1 && clock_anchors_[1].pts <= pts) {
+    clock_anchors_.pop_front();
+  }
+  const ClockAnchor & anchor = clock_anchors_.front();
+  packet->timestamp = anchor.time + SamplesDuration(pts - anchor.pts,
+                                                    encoder_->sample_rate);
+  packet->keyframe = true;
+  packets_.push(packet);
+}
+
+}  // namespace foscam_hd
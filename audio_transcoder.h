@@ -0,0 +1,119 @@
+#ifndef AUDIO_TRANSCODER_H_
+#define AUDIO_TRANSCODER_H_
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+}
+
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "broadcast_ring.h"
+#include "buffer_limits.h"
+#include "packet_pool.h"
+#include "pcm_resampler.h"
+#include "worker_pool.h"
+
+namespace foscam_hd {
+
+class AudioTranscoderException : public std::exception {
+ public:
+  explicit AudioTranscoderException(const std::string & what);
+
+  const char* what() const noexcept override;
+
+ private:
+  std::string what_;
+};
+
+// Turns the camera's 8 kHz PCM into 44.1 kHz MP3 once per camera. Encoded
+// frames are published to a ring shared by every consumer, so the audio
+// cost does not depend on the number of viewers.
+//
+// Everything the transcode loop touches is allocated when the codecs are
+// opened: resampled samples go straight into a fixed-capacity FIFO that the
+// encoder reads in place, and MP3 frames are encoded into pooled packets.
+class AudioTranscoder {
+ public:
+  // Upsampling by libswresample or by the fixed-ratio CameraPcmResampler
+  enum class Resampler {SWR, NATIVE};
+
+  struct Config {
+    unsigned int sample_rate;
+    unsigned int channels;
+    unsigned int frame_size;
+    unsigned int bit_rate;
+  };
+
+  AudioTranscoder(WorkerPool & worker_pool, BroadcastRing & pcm_ring,
+                  const BufferLimits & input_limits,
+                  Resampler resampler = Resampler::NATIVE);
+  ~AudioTranscoder();
+
+  const Config & config() const;
+  // MP3 frames, timestamped with the arrival time of their first sample
+  BroadcastRing & packets();
+  DropStats input_drop_stats() const;
+
+ private:
+  class Registrator {
+   public:
+    Registrator();
+  };
+
+  struct AVFrameDeleter {
+    void operator()(AVFrame * p) {
+      av_frame_free(&p);
+    }
+  };
+  typedef std::unique_ptr<AVFrame, AVFrameDeleter> AVFramePtr;
+
+  void OpenCodecs();
+  void Release();
+
+  void InputReady();
+  void TranscodeAudioPacket(const MediaPacket & pcm_packet);
+  int Resample(const int16_t * input, int count, int16_t * output,
+               int capacity);
+  void EncodeAvailableFrames(std::chrono::steady_clock::time_point arrival);
+  void EncodeFrame(AVFrame * frame);
+
+  Registrator registrator_;
+  BroadcastRing::Reader input_reader_;
+  BroadcastRing packets_;
+  std::shared_ptr<PacketPool> packet_pool_;
+
+  AVCodecContext * encoder_;
+  SwrContext * audio_resampler_;
+  std::unique_ptr<CameraPcmResampler> native_resampler_;
+  AVFramePtr frame_;
+  // Resampled samples waiting for a full encoder frame
+  std::vector<int16_t> fifo_;
+  size_t fifo_size_;
+  Config config_;
+
+  // Steady clock time of a pts, timestamps count on from the latest anchor
+  // at or before them
+  struct ClockAnchor {
+    int64_t pts;
+    std::chrono::steady_clock::time_point time;
+  };
+  // A new anchor is added whenever the input departs from the samples
+  // counted so far, after dropped input or as the camera clock drifts
+  std::deque<ClockAnchor> clock_anchors_;
+  int64_t next_pts_;
+
+  // Last so the task is stopped before anything it uses goes away
+  WorkerPool::Task input_task_;
+
+  AudioTranscoder(const AudioTranscoder &) = delete;
+  AudioTranscoder & operator=(const AudioTranscoder &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // AUDIO_TRANSCODER_H_
@@ -0,0 +1,700 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/buffer.hpp>
+
+#include "audio_transcoder.h"
+#include "broadcast_ring.h"
+#include "foscam_protocol.h"
+#include "notifier.h"
+#include "packet_pool.h"
+#include "pcm_resampler.h"
+#include "remux_session.h"
+#include "worker_pool.h"
+
+namespace {
+
+using foscam_hd::CameraPcmResampler;
+
+typedef std::chrono::steady_clock Clock;
+
+const unsigned int FRAMERATE = 30;
+const unsigned int GOP_LENGTH = 30;
+const unsigned int SIMULATED_SECONDS = 60;
+
+// Camera -> remuxer -> viewer hand-off: a packet crosses two rings, each
+// hop either polling every 10 ms or woken by a Notifier.
+const size_t WAKEUP_PACKETS = 200;
+const std::chrono::milliseconds WAKEUP_INTERVAL(5);
+const std::chrono::milliseconds POLL_INTERVAL(10);
+
+typedef std::function<size_t(uint8_t *, size_t)> ReadFunc;
+
+ReadFunc MakeRingRead(foscam_hd::BroadcastRing::Reader & reader,
+                      foscam_hd::Notifier * notifier) {
+  if (!notifier) {
+    return [&reader](uint8_t * data, size_t size) {
+      size_t read;
+      while ((read = reader.try_read(data, size)) == 0) {
+        std::this_thread::sleep_for(POLL_INTERVAL);
+      }
+      return read;
+    };
+  }
+
+  reader.set_notifier(notifier);
+  return [&reader, notifier](uint8_t * data, size_t size) {
+    while (true) {
+      uint64_t generation = notifier->generation();
+      size_t read = reader.try_read(data, size);
+      if (read > 0) {
+        return read;
+      }
+      notifier->Wait(generation, std::chrono::milliseconds(1000));
+    }
+  };
+}
+
+void PushTimestamp(foscam_hd::PacketPool & pool,
+                   foscam_hd::BroadcastRing & ring, Clock::time_point time) {
+  auto packet = pool.Acquire(sizeof(time));
+  packet->data.resize(sizeof(time));
+  memcpy(packet->data.data(), &time, sizeof(time));
+  packet->timestamp = time;
+  packet->keyframe = true;
+  ring.push(std::move(packet));
+}
+
+std::vector<double> RunWakeup(bool notify) {
+  auto pool = std::make_shared<foscam_hd::PacketPool>();
+  foscam_hd::BroadcastRing camera_ring(WAKEUP_PACKETS);
+  foscam_hd::BroadcastRing output_ring(WAKEUP_PACKETS);
+  foscam_hd::Notifier remuxer_notifier;
+  foscam_hd::Notifier viewer_notifier;
+  foscam_hd::BroadcastRing::Reader remuxer_reader(camera_ring);
+  foscam_hd::BroadcastRing::Reader viewer_reader(output_ring);
+  ReadFunc remuxer_read = MakeRingRead(remuxer_reader,
+      notify ? &remuxer_notifier : nullptr);
+  ReadFunc viewer_read = MakeRingRead(viewer_reader,
+      notify ? &viewer_notifier : nullptr);
+
+  std::thread remuxer([&]() {
+    Clock::time_point time;
+    for (size_t idx = 0; idx < WAKEUP_PACKETS; idx++) {
+      remuxer_read(reinterpret_cast<uint8_t *>(&time), sizeof(time));
+      PushTimestamp(*pool, output_ring, time);
+    }
+  });
+  std::thread camera([&]() {
+    for (size_t idx = 0; idx < WAKEUP_PACKETS; idx++) {
+      PushTimestamp(*pool, camera_ring, Clock::now());
+      std::this_thread::sleep_for(WAKEUP_INTERVAL);
+    }
+  });
+
+  std::vector<double> latencies;
+  Clock::time_point time;
+  for (size_t idx = 0; idx < WAKEUP_PACKETS; idx++) {
+    viewer_read(reinterpret_cast<uint8_t *>(&time), sizeof(time));
+    latencies.push_back(
+        std::chrono::duration<double, std::milli>(Clock::now() - time).count());
+  }
+  camera.join();
+  remuxer.join();
+
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+void BenchWakeup() {
+  std::cout << "Wakeup: " << WAKEUP_PACKETS << " packets through two ring hops"
+            << std::endl;
+  for (bool notify : {false, true}) {
+    auto latencies = RunWakeup(notify);
+    double mean = std::accumulate(latencies.begin(), latencies.end(), 0.0) /
+        latencies.size();
+    double p99 = latencies[latencies.size() * 99 / 100];
+    std::cout << "  " << (notify ? "notify" : "poll " + std::to_string(
+                     POLL_INTERVAL.count()) + " ms")
+              << ": mean " << std::fixed << std::setprecision(3)
+              << mean / 2 << " ms/hop, p99 " << p99 / 2 << " ms/hop"
+              << std::endl;
+  }
+}
+
+// Camera PCM through AudioTranscoder as fast as it can encode, reported as
+// transcode time per second of audio.
+const unsigned int PCM_SAMPLE_RATE = 8000;
+const unsigned int PCM_PACKET_SAMPLES = 320;
+const double PCM_TONE_HZ = 440.0;
+
+void BenchAudioTranscode() {
+  auto pool = std::make_shared<foscam_hd::PacketPool>();
+  const size_t packet_count =
+      SIMULATED_SECONDS * PCM_SAMPLE_RATE / PCM_PACKET_SAMPLES;
+  foscam_hd::BroadcastRing pcm_ring(packet_count);
+  foscam_hd::WorkerPool worker_pool;
+  foscam_hd::AudioTranscoder transcoder(worker_pool, pcm_ring,
+                                        foscam_hd::BufferLimits());
+  auto & config = transcoder.config();
+
+  foscam_hd::Notifier notifier;
+  foscam_hd::BroadcastRing::Reader reader(transcoder.packets());
+  reader.set_notifier(&notifier);
+
+  // The encoder holds back a few frames of delay
+  const size_t expected_frames =
+      SIMULATED_SECONDS * config.sample_rate / config.frame_size - 4;
+
+  auto start = Clock::now();
+  for (size_t idx = 0; idx < packet_count; idx++) {
+    auto packet = pool->Acquire(PCM_PACKET_SAMPLES * sizeof(int16_t));
+    auto samples = reinterpret_cast<int16_t *>(packet->data.data());
+    for (unsigned int sample = 0; sample < PCM_PACKET_SAMPLES; sample++) {
+      double time = static_cast<double>(idx * PCM_PACKET_SAMPLES + sample) /
+          PCM_SAMPLE_RATE;
+      samples[sample] = 8000 * std::sin(2 * M_PI * PCM_TONE_HZ * time);
+    }
+    packet->timestamp = Clock::now();
+    packet->keyframe = true;
+    pcm_ring.push(std::move(packet));
+  }
+
+  size_t frames = 0;
+  auto end = start;
+  while (frames < expected_frames) {
+    uint64_t generation = notifier.generation();
+    if (reader.try_read_packet()) {
+      frames++;
+      end = Clock::now();
+      continue;
+    }
+    notifier.Wait(generation, std::chrono::milliseconds(1000));
+    if (notifier.generation() == generation) {
+      break;
+    }
+  }
+  reader.set_notifier(nullptr);
+
+  double elapsed = std::chrono::duration<double, std::milli>(
+      end - start).count();
+  double seconds = static_cast<double>(frames) * config.frame_size /
+      config.sample_rate;
+  std::cout << "Audio transcode: " << frames << " MP3 frames, "
+            << std::fixed << std::setprecision(3) << elapsed / seconds
+            << " ms per second of audio" << std::endl;
+}
+
+// 8 kHz to 44.1 kHz upsampling of test tones by libswresample and by
+// CameraPcmResampler. Quality is the SNR against the best fitting sine at
+// the output rate, which counts images, aliasing and noise; gain shows the
+// passband droop.
+const unsigned int RESAMPLED_RATE = 44100;
+const double RESAMPLER_TONES_HZ[] = {100, 440, 1000, 2000, 3000, 3500};
+const double RESAMPLER_AMPLITUDE = 16000;
+const size_t RESAMPLER_SKIPPED_SAMPLES = 4096;
+
+std::vector<int16_t> MakeTone(double frequency, unsigned int rate,
+                              size_t count) {
+  std::vector<int16_t> tone(count);
+  for (size_t idx = 0; idx < count; idx++) {
+    tone[idx] = std::lround(RESAMPLER_AMPLITUDE *
+                            std::sin(2 * M_PI * frequency * idx / rate));
+  }
+  return tone;
+}
+
+// Least squares fit of a sine of the known frequency, skipping the filter
+// start-up
+void MeasureTone(const std::vector<int16_t> & samples, double frequency,
+                 double & snr, double & gain) {
+  double ss = 0, cc = 0, sc = 0, ys = 0, yc = 0;
+  for (size_t idx = RESAMPLER_SKIPPED_SAMPLES; idx < samples.size(); idx++) {
+    double s = std::sin(2 * M_PI * frequency * idx / RESAMPLED_RATE);
+    double c = std::cos(2 * M_PI * frequency * idx / RESAMPLED_RATE);
+    ss += s * s;
+    cc += c * c;
+    sc += s * c;
+    ys += samples[idx] * s;
+    yc += samples[idx] * c;
+  }
+  double det = ss * cc - sc * sc;
+  double a = (ys * cc - yc * sc) / det;
+  double b = (yc * ss - ys * sc) / det;
+
+  double signal = 0, noise = 0;
+  for (size_t idx = RESAMPLER_SKIPPED_SAMPLES; idx < samples.size(); idx++) {
+    double fit = a * std::sin(2 * M_PI * frequency * idx / RESAMPLED_RATE) +
+        b * std::cos(2 * M_PI * frequency * idx / RESAMPLED_RATE);
+    signal += fit * fit;
+    noise += (samples[idx] - fit) * (samples[idx] - fit);
+  }
+  snr = 10 * std::log10(signal / noise);
+  gain = 20 * std::log10(std::sqrt(a * a + b * b) / RESAMPLER_AMPLITUDE);
+}
+
+typedef std::function<size_t(const int16_t *, size_t, int16_t *, size_t)>
+    ResampleFunc;
+
+std::vector<int16_t> RunResampler(const ResampleFunc & resample,
+                                  const std::vector<int16_t> & input,
+                                  double & elapsed) {
+  std::vector<int16_t> output(CameraPcmResampler::max_output(input.size()) +
+                              RESAMPLED_RATE);
+  size_t produced = 0;
+  auto start = Clock::now();
+  for (size_t offset = 0; offset < input.size();
+       offset += PCM_PACKET_SAMPLES) {
+    size_t count = std::min<size_t>(PCM_PACKET_SAMPLES, input.size() - offset);
+    produced += resample(input.data() + offset, count,
+                         output.data() + produced, output.size() - produced);
+  }
+  elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  output.resize(produced);
+  return output;
+}
+
+void BenchResampler() {
+  std::cout << "Resampler: " << SIMULATED_SECONDS << " s tones, "
+            << PCM_SAMPLE_RATE << " Hz to " << RESAMPLED_RATE << " Hz"
+            << std::endl;
+  for (bool native : {false, true}) {
+    double total_elapsed = 0;
+    size_t total_samples = 0;
+    std::cout << "  " << (native ? "native" : "swr") << ":";
+    for (double frequency : RESAMPLER_TONES_HZ) {
+      auto input = MakeTone(frequency, PCM_SAMPLE_RATE,
+                            SIMULATED_SECONDS * PCM_SAMPLE_RATE);
+      std::vector<int16_t> output;
+      double elapsed;
+      if (native) {
+        foscam_hd::CameraPcmResampler resampler;
+        output = RunResampler(
+            [&resampler](const int16_t * in, size_t count, int16_t * out,
+                         size_t) {
+              return resampler.Process(in, count, out);
+            }, input, elapsed);
+      } else {
+        SwrContext * swr = swr_alloc_set_opts(
+            nullptr, AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_S16, RESAMPLED_RATE,
+            AV_CH_LAYOUT_MONO, AV_SAMPLE_FMT_S16, PCM_SAMPLE_RATE, 0,
+            nullptr);
+        swr_init(swr);
+        output = RunResampler(
+            [swr](const int16_t * in, size_t count, int16_t * out,
+                  size_t capacity) {
+              auto swr_in = reinterpret_cast<const uint8_t *>(in);
+              auto swr_out = reinterpret_cast<uint8_t *>(out);
+              return std::max(0, swr_convert(swr, &swr_out, capacity,
+                                             &swr_in, count));
+            }, input, elapsed);
+        swr_free(&swr);
+      }
+      total_elapsed += elapsed;
+      total_samples += output.size();
+
+      double snr, gain;
+      MeasureTone(output, frequency, snr, gain);
+      std::cout << " " << std::setprecision(0) << frequency << " Hz "
+                << std::setprecision(1) << snr << " dB SNR "
+                << std::setprecision(2) << gain << " dB,";
+    }
+    std::cout << " " << std::setprecision(1)
+              << total_samples / total_elapsed / 1e6 << " Msamples/s"
+              << std::endl;
+  }
+}
+
+// Camera access units through a RemuxSession in each mode, timed from the
+// arrival of the first frame of a fragment to the fragment being readable.
+const unsigned int LATENCY_SECONDS = 5;
+const size_t LATENCY_FRAME_SIZE = 8 * 1024;
+
+// 1280x720 high profile SPS and a PPS
+const uint8_t LATENCY_PARAMETER_SETS[] = {
+  0, 0, 0, 1, 0x67, 0x64, 0x00, 0x1f, 0xac, 0xd9, 0x40, 0x50, 0x05, 0xbb,
+  0x01, 0x10, 0x00, 0x00, 0x03, 0x00, 0x10, 0x00, 0x00, 0x03, 0x03, 0x20,
+  0xf1, 0x83, 0x19, 0x60,
+  0, 0, 0, 1, 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0
+};
+
+std::vector<double> RunFragmentLatency(foscam_hd::RemuxSession::Mode mode) {
+  auto pool = std::make_shared<foscam_hd::PacketPool>();
+  foscam_hd::WorkerPool worker_pool;
+  foscam_hd::BroadcastRing video_ring(GOP_LENGTH * 4);
+  std::vector<uint8_t> parameter_sets(
+      LATENCY_PARAMETER_SETS,
+      LATENCY_PARAMETER_SETS + sizeof(LATENCY_PARAMETER_SETS));
+  foscam_hd::RemuxSession session(worker_pool, video_ring, nullptr, mode,
+                                  foscam_hd::BufferLimits(), parameter_sets,
+                                  FRAMERATE);
+
+  foscam_hd::Notifier notifier;
+  foscam_hd::BroadcastRing::Reader reader(session.fragments());
+  reader.set_notifier(&notifier);
+
+  std::thread camera([&]() {
+    auto next = Clock::now();
+    for (unsigned int idx = 0; idx < LATENCY_SECONDS * FRAMERATE; idx++) {
+      bool keyframe = idx % GOP_LENGTH == 0;
+      size_t header_size = keyframe ? sizeof(LATENCY_PARAMETER_SETS) : 0;
+      auto packet = pool->Acquire(header_size + LATENCY_FRAME_SIZE);
+      uint8_t * data = packet->data.data();
+      memcpy(data, LATENCY_PARAMETER_SETS, header_size);
+      memset(data + header_size, 0x80, LATENCY_FRAME_SIZE);
+      const uint8_t slice_header[] = {0, 0, 0, 1,
+                                      static_cast<uint8_t>(keyframe ? 0x65 :
+                                                                      0x41)};
+      memcpy(data + header_size, slice_header, sizeof(slice_header));
+      packet->timestamp = Clock::now();
+      packet->keyframe = keyframe;
+      video_ring.push(std::move(packet));
+
+      next += std::chrono::microseconds(1000000 / FRAMERATE);
+      std::this_thread::sleep_until(next);
+    }
+  });
+
+  std::vector<double> latencies;
+  auto end = Clock::now() + std::chrono::seconds(LATENCY_SECONDS);
+  while (Clock::now() < end) {
+    uint64_t generation = notifier.generation();
+    auto fragment = reader.try_read_packet();
+    if (!fragment) {
+      notifier.Wait(generation, std::chrono::milliseconds(100));
+      continue;
+    }
+    latencies.push_back(std::chrono::duration<double, std::milli>(
+        Clock::now() - fragment->timestamp).count());
+  }
+  camera.join();
+  reader.set_notifier(nullptr);
+
+  std::sort(latencies.begin(), latencies.end());
+  return latencies;
+}
+
+void BenchFragmentLatency() {
+  std::cout << "Fragment latency: " << FRAMERATE << " fps, GOP of "
+            << GOP_LENGTH << " frames" << std::endl;
+  for (auto mode : {foscam_hd::RemuxSession::Mode::GOP,
+                    foscam_hd::RemuxSession::Mode::LOW_LATENCY}) {
+    auto latencies = RunFragmentLatency(mode);
+    if (latencies.empty()) {
+      continue;
+    }
+    double mean = std::accumulate(latencies.begin(), latencies.end(), 0.0) /
+        latencies.size();
+    std::cout << "  " << (mode == foscam_hd::RemuxSession::Mode::GOP ?
+                          "gop" : "low latency")
+              << ": " << latencies.size() << " fragments, mean "
+              << std::fixed << std::setprecision(3) << mean << " ms, max "
+              << latencies.back() << " ms" << std::endl;
+  }
+}
+
+// Per-byte Fusion visitors the camera protocol was serialized with before
+// the wire layouts were computed at compile time. Kept here as the
+// comparison baseline.
+namespace visitor_baseline {
+
+namespace baio = boost::asio;
+namespace endian = foscam_api::endian;
+
+struct Reader {
+  mutable baio::const_buffer buf_;
+
+  explicit Reader(baio::const_buffer buf)
+      : buf_(std::move(buf)) {
+  }
+
+  template<class T>
+  auto operator()(T & val) const ->
+  typename std::enable_if<std::is_integral<T>::value>::type {
+    val = endian::ntoh(*baio::buffer_cast<T const*>(buf_));
+    buf_ = buf_ + sizeof(T);
+  }
+
+  template<class T>
+  auto operator()(T & val) const ->
+  typename std::enable_if<std::is_enum<T>::value>::type {
+    typename std::underlying_type<T>::type v;
+    (*this)(v);
+    val = static_cast<T>(v);
+  }
+
+  template<class T, T v>
+  void operator()(std::integral_constant<T, v>) const {
+    T val;
+    (*this)(val);
+    if (val != v)
+      throw foscam_hd::ProtocolException("Invalid integral constant.");
+  }
+
+  template<size_t N>
+  void operator()(foscam_api::Reserved<N>) const {
+    buf_ = buf_ + N;
+  }
+
+  template<size_t N>
+  void operator()(foscam_api::FixedString<N>& val) const {
+    for (size_t idx = 0; idx < N; idx++) {
+      char v;
+      (*this)(v);
+      val.str[idx] = v;
+    }
+  }
+
+  template<class T>
+  auto operator()(T & val) const ->
+  typename std::enable_if<boost::fusion::traits::is_sequence<T>::value>::type {
+    boost::fusion::for_each(val, *this);
+  }
+};
+
+struct Writer {
+  mutable baio::mutable_buffer buf_;
+
+  explicit Writer(baio::mutable_buffer buf)
+      : buf_(std::move(buf)) {
+  }
+
+  template<class T>
+  auto operator()(T const& val) const ->
+  typename std::enable_if<std::is_integral<T>::value>::type {
+    T tmp = endian::hton(val);
+    baio::buffer_copy(buf_, baio::buffer(&tmp, sizeof(T)));
+    buf_ = buf_ + sizeof(T);
+  }
+
+  template<class T>
+  auto operator()(T const& val) const ->
+  typename std::enable_if<std::is_enum<T>::value>::type {
+    using utype = typename std::underlying_type<T>::type;
+    (*this)(static_cast<utype>(val));
+  }
+
+  template<class T, T v>
+  void operator()(std::integral_constant<T, v>) const {
+    (*this)(v);
+  }
+
+  template<size_t N>
+  void operator()(foscam_api::Reserved<N>) const {
+    for (size_t idx = 0; idx < N; idx++) {
+      (*this)(static_cast<uint8_t>(0));
+    }
+  }
+
+  template<size_t N>
+  void operator()(foscam_api::FixedString<N> const& val) const {
+    for (size_t idx = 0; idx < N; idx++) {
+      (*this)(val.str[idx]);
+    }
+  }
+
+  template<class T>
+  auto operator()(T const& val) const ->
+  typename std::enable_if<boost::fusion::traits::is_sequence<T>::value>::type {
+    boost::fusion::for_each(val, *this);
+  }
+};
+
+// Counts into size_, fusion::for_each takes its visitor by value
+struct Sizer {
+  size_t & size_;
+
+  template<class T>
+  auto operator()(T const&) const ->
+  typename std::enable_if<std::is_integral<T>::value ||
+                          std::is_enum<T>::value>::type {
+    size_ += foscam_api::wire_size<T>();
+  }
+
+  template<class T, T v>
+  void operator()(std::integral_constant<T, v>) const {
+    size_ += sizeof(T);
+  }
+
+  template<size_t N>
+  void operator()(foscam_api::Reserved<N>) const {
+    size_ += N;
+  }
+
+  template<size_t N>
+  void operator()(foscam_api::FixedString<N>) const {
+    size_ += N;
+  }
+
+  template<class T>
+  auto operator()(T const& val) const ->
+  typename std::enable_if<boost::fusion::traits::is_sequence<T>::value>::type {
+    boost::fusion::for_each(val, *this);
+  }
+};
+
+template<class T>
+size_t get_size() {
+  size_t size = 0;
+  Sizer s{size};
+  T v;
+  s(v);
+  return size;
+}
+
+foscam_api::Header DecodeHeader(const uint8_t * data) {
+  Reader r(baio::buffer(data, get_size<foscam_api::Header>()));
+  foscam_api::Header header;
+  r(header);
+  return header;
+}
+
+template<class T>
+std::vector<uint8_t> EncodeCommand(foscam_api::Command type,
+                                   const T & request) {
+  foscam_api::Header header;
+  header.type = type;
+  header.size = get_size<T>();
+
+  auto header_size = get_size<foscam_api::Header>();
+  std::vector<uint8_t> message_buf(header_size + header.size);
+  Writer(baio::buffer(message_buf))(header);
+  Writer(baio::buffer(message_buf) + header_size)(request);
+  return message_buf;
+}
+
+}  // namespace visitor_baseline
+
+// The receive loop decodes a header per camera message, about 60 a second;
+// commands are encoded once per connection. Both are timed in a tight loop.
+const size_t PROTOCOL_MESSAGES = 4096;
+const unsigned int PROTOCOL_ROUNDS = 500;
+const unsigned int PROTOCOL_TRIALS = 5;
+
+template<typename Decode>
+double RunHeaderDecode(const std::vector<uint8_t> & messages,
+                       const Decode & decode, uint64_t & checksum) {
+  const size_t header_size = foscam_api::wire_size<foscam_api::Header>();
+  uint64_t sum = 0;
+  auto start = Clock::now();
+  for (unsigned int round = 0; round < PROTOCOL_ROUNDS; round++) {
+    for (size_t offset = 0; offset < messages.size(); offset += header_size) {
+      sum += decode(messages.data() + offset).size;
+    }
+  }
+  auto elapsed = Clock::now() - start;
+  checksum += sum;
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+      (PROTOCOL_ROUNDS * PROTOCOL_MESSAGES);
+}
+
+template<typename Encode>
+double RunCommandEncode(const foscam_api::VideoOnRequest & request,
+                        const Encode & encode, uint64_t & checksum) {
+  uint64_t sum = 0;
+  auto start = Clock::now();
+  for (unsigned int round = 0; round < PROTOCOL_ROUNDS; round++) {
+    for (size_t idx = 0; idx < PROTOCOL_MESSAGES / 16; idx++) {
+      sum += encode(request).back();
+    }
+  }
+  auto elapsed = Clock::now() - start;
+  checksum += sum;
+  return std::chrono::duration<double, std::nano>(elapsed).count() /
+      (PROTOCOL_ROUNDS * PROTOCOL_MESSAGES / 16);
+}
+
+void BenchProtocol() {
+  const size_t header_size = foscam_api::wire_size<foscam_api::Header>();
+  std::vector<uint8_t> messages(header_size * PROTOCOL_MESSAGES);
+  for (size_t idx = 0; idx < PROTOCOL_MESSAGES; idx++) {
+    foscam_api::Header header;
+    header.type = foscam_api::Command::VIDEO_DATA;
+    header.size = static_cast<uint32_t>(idx);
+    foscam_api::Encode(header, messages.data() + idx * header_size);
+  }
+
+  foscam_api::VideoOnRequest request{};
+  strncpy(request.username.str, "admin", request.username.size);
+  strncpy(request.password.str, "password", request.password.size);
+  request.uid = 1;
+
+  // Alternated and the best of each kept, as both are only a few ns
+  uint64_t visitor_checksum = 0;
+  uint64_t compiled_checksum = 0;
+  double visitor_decode = INFINITY;
+  double compiled_decode = INFINITY;
+  double visitor_encode = INFINITY;
+  double compiled_encode = INFINITY;
+  for (unsigned int trial = 0; trial < PROTOCOL_TRIALS; trial++) {
+    visitor_decode = std::min(visitor_decode, RunHeaderDecode(
+        messages, visitor_baseline::DecodeHeader, visitor_checksum));
+    compiled_decode = std::min(compiled_decode, RunHeaderDecode(
+        messages, [](const uint8_t * data) {
+          return foscam_api::Decode<foscam_api::Header>(
+              data, foscam_api::wire_size<foscam_api::Header>());
+        }, compiled_checksum));
+    visitor_encode = std::min(visitor_encode, RunCommandEncode(
+        request, [](const foscam_api::VideoOnRequest & request) {
+          return visitor_baseline::EncodeCommand(
+              foscam_api::Command::VIDEO_ON_REQUEST, request);
+        }, visitor_checksum));
+    compiled_encode = std::min(compiled_encode, RunCommandEncode(
+        request, [](const foscam_api::VideoOnRequest & request) {
+          return foscam_api::EncodeCommand(
+              foscam_api::Command::VIDEO_ON_REQUEST, request);
+        }, compiled_checksum));
+  }
+
+  bool same = visitor_checksum == compiled_checksum &&
+      visitor_baseline::EncodeCommand(foscam_api::Command::VIDEO_ON_REQUEST,
+                                      request) ==
+      foscam_api::EncodeCommand(foscam_api::Command::VIDEO_ON_REQUEST,
+                                request);
+  std::cout << "Protocol: " << PROTOCOL_MESSAGES << " messages x "
+            << PROTOCOL_ROUNDS << " rounds, best of " << PROTOCOL_TRIALS
+            << (same ? "" : ", OUTPUT DIFFERS") << std::endl;
+  std::cout << "  header decode: visitor " << std::fixed
+            << std::setprecision(1) << visitor_decode << " ns, compiled "
+            << compiled_decode << " ns (" << visitor_decode / compiled_decode
+            << "x)" << std::endl;
+  std::cout << "  command encode: visitor " << visitor_encode
+            << " ns, compiled " << compiled_encode << " ns ("
+            << visitor_encode / compiled_encode << "x)" << std::endl;
+}
+
+struct Benchmark {
+  const char * name;
+  std::function<void()> run;
+};
+
+}  // namespace
+
+int main(int argc, char * argv[]) {
+  const std::vector<Benchmark> benchmarks = {
+    {"wakeup", BenchWakeup},
+    {"audio_transcode", BenchAudioTranscode},
+    {"resampler", BenchResampler},
+    {"fragment_latency", BenchFragmentLatency},
+    {"protocol", BenchProtocol},
+  };
+
+  for (auto & benchmark : benchmarks) {
+    if (argc > 1 && std::string(argv[1]) != benchmark.name) {
+      continue;
+    }
+    benchmark.run();
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,238 @@
+#include "broadcast_ring.h"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace foscam_hd {
+
+BroadcastRing::BroadcastRing(size_t capacity)
+    : slots_(capacity), head_(0), stream_size_(0) {
+}
+
+void BroadcastRing::push(MediaPacketPtr packet) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  Slot & slot = slots_[head_ % slots_.size()];
+  std::swap(slot.packet, packet);
+  slot.stream_offset = stream_size_;
+  stream_size_ += slot.packet->data.size();
+  head_++;
+  for (auto notifier : notifiers_) {
+    notifier->Notify();
+  }
+  lock.unlock();
+  data_available_.notify_all();
+
+  // The evicted packet, if any, is released here outside the lock
+}
+
+uint64_t BroadcastRing::OldestLocked() const {
+  return head_ > slots_.size() ? head_ - slots_.size() : 0;
+}
+
+uint64_t BroadcastRing::StreamOffsetLocked(uint64_t sequence) const {
+  return sequence < head_ ?
+      slots_[sequence % slots_.size()].stream_offset : stream_size_;
+}
+
+BroadcastRing::Reader::Reader(BroadcastRing & ring, Start start)
+    : ring_(ring), current_offset_(0), notifier_(nullptr), resync_(true),
+      started_(false) {
+  std::lock_guard<std::mutex> lock(ring_.mutex_);
+  sequence_ = ring_.head_;
+  if (start == Start::LAST_KEYFRAME) {
+    uint64_t capacity = ring_.slots_.size();
+    for (uint64_t sequence = ring_.head_;
+         sequence-- > ring_.OldestLocked();) {
+      if (ring_.slots_[sequence % capacity].packet->keyframe) {
+        sequence_ = sequence;
+        break;
+      }
+    }
+  }
+  stream_offset_ = ring_.StreamOffsetLocked(sequence_);
+}
+
+BroadcastRing::Reader::~Reader() {
+  set_notifier(nullptr);
+}
+
+void BroadcastRing::Reader::set_notifier(Notifier * notifier) {
+  std::lock_guard<std::mutex> lock(ring_.mutex_);
+  auto & notifiers = ring_.notifiers_;
+  if (notifier_) {
+    notifiers.erase(std::find(notifiers.begin(), notifiers.end(), notifier_));
+  }
+  notifier_ = notifier;
+  if (notifier_) {
+    notifiers.push_back(notifier_);
+  }
+}
+
+void BroadcastRing::Reader::set_limits(const BufferLimits & limits) {
+  std::lock_guard<std::mutex> lock(ring_.mutex_);
+  limits_ = limits;
+}
+
+DropStats BroadcastRing::Reader::drop_stats() const {
+  std::lock_guard<std::mutex> lock(ring_.mutex_);
+  return drop_stats_;
+}
+
+size_t BroadcastRing::Reader::read_available() const {
+  size_t available = current_ ? current_->data.size() - current_offset_ : 0;
+
+  std::lock_guard<std::mutex> lock(ring_.mutex_);
+  uint64_t sequence = std::max(sequence_, ring_.OldestLocked());
+  return available + ring_.stream_size_ - ring_.StreamOffsetLocked(sequence);
+}
+
+size_t BroadcastRing::Reader::try_read(uint8_t * data, size_t max_size) {
+  return CopyOut(data, max_size);
+}
+
+size_t BroadcastRing::Reader::wait_and_read(
+    uint8_t * data, size_t max_size, std::chrono::milliseconds timeout) {
+  if (!current_) {
+    std::unique_lock<std::mutex> lock(ring_.mutex_);
+    ring_.data_available_.wait_for(lock, timeout, [this]() {
+      return sequence_ < ring_.head_;
+    });
+  }
+
+  return CopyOut(data, max_size);
+}
+
+MediaPacketPtr BroadcastRing::Reader::try_read_packet() {
+  std::lock_guard<std::mutex> lock(ring_.mutex_);
+  if (!current_ && !FetchLocked()) {
+    return nullptr;
+  }
+
+  MediaPacketPtr packet;
+  std::swap(packet, current_);
+  current_offset_ = 0;
+  return packet;
+}
+
+size_t BroadcastRing::Reader::CopyOut(uint8_t * data, size_t max_size) {
+  size_t read = 0;
+  while (read < max_size) {
+    if (!current_) {
+      std::lock_guard<std::mutex> lock(ring_.mutex_);
+      if (!FetchLocked()) {
+        break;
+      }
+    }
+
+    // Packets are immutable once pushed, copy without holding the lock
+    size_t size = std::min(current_->data.size() - current_offset_,
+                           max_size - read);
+    memcpy(data + read, current_->data.data() + current_offset_, size);
+    read += size;
+    current_offset_ += size;
+    if (current_offset_ == current_->data.size()) {
+      current_.reset();
+    }
+  }
+
+  return read;
+}
+
+bool BroadcastRing::Reader::FetchLocked() {
+  uint64_t oldest = ring_.OldestLocked();
+  if (sequence_ < oldest) {
+    // Lapped by the writer
+    drop_stats_.drop_events++;
+    SkipToLocked(oldest, true);
+    resync_ = true;
+  }
+
+  EnforceLimitsLocked();
+
+  uint64_t capacity = ring_.slots_.size();
+  if (resync_) {
+    uint64_t sequence = sequence_;
+    while (sequence < ring_.head_ &&
+           !ring_.slots_[sequence % capacity].packet->keyframe) {
+      sequence++;
+    }
+    SkipToLocked(sequence, started_);
+    if (sequence == ring_.head_) {
+      return false;
+    }
+    resync_ = false;
+  }
+
+  if (sequence_ >= ring_.head_) {
+    return false;
+  }
+
+  current_ = ring_.slots_[sequence_ % capacity].packet;
+  current_offset_ = 0;
+  sequence_++;
+  stream_offset_ += current_->data.size();
+  started_ = true;
+
+  return true;
+}
+
+void BroadcastRing::Reader::EnforceLimitsLocked() {
+  if (!limits_.bounded() || sequence_ >= ring_.head_) {
+    return;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  uint64_t capacity = ring_.slots_.size();
+  auto within_limits = [this, now, capacity](uint64_t sequence) {
+    auto & packet = ring_.slots_[sequence % capacity].packet;
+    uint64_t bytes = ring_.stream_size_ - ring_.StreamOffsetLocked(sequence);
+    return (limits_.max_bytes == 0 || bytes <= limits_.max_bytes) &&
+        (limits_.max_delay.count() == 0 ||
+         now - packet->timestamp <= limits_.max_delay);
+  };
+
+  if (within_limits(sequence_)) {
+    return;
+  }
+
+  // Skip to the earliest keyframe from which the backlog fits the limits,
+  // or failing that the latest keyframe.
+  uint64_t target = ring_.head_;
+  uint64_t last_keyframe = ring_.head_;
+  for (uint64_t sequence = ring_.head_; sequence-- > sequence_ + 1;) {
+    if (!ring_.slots_[sequence % capacity].packet->keyframe) {
+      continue;
+    }
+    if (last_keyframe == ring_.head_) {
+      last_keyframe = sequence;
+    }
+    if (within_limits(sequence)) {
+      target = sequence;
+    } else {
+      break;
+    }
+  }
+  if (target == ring_.head_) {
+    target = last_keyframe;
+  }
+
+  drop_stats_.drop_events++;
+  SkipToLocked(target, true);
+  if (target == ring_.head_) {
+    resync_ = true;
+  }
+}
+
+void BroadcastRing::Reader::SkipToLocked(uint64_t sequence,
+                                         bool count_drops) {
+  uint64_t stream_offset = ring_.StreamOffsetLocked(sequence);
+  if (count_drops) {
+    drop_stats_.dropped_packets += sequence - sequence_;
+    drop_stats_.dropped_bytes += stream_offset - stream_offset_;
+  }
+  sequence_ = sequence;
+  stream_offset_ = stream_offset;
+}
+
+}  // namespace foscam_hd
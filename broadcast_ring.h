@@ -0,0 +1,97 @@
+#ifndef BROADCAST_RING_H_
+#define BROADCAST_RING_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "buffer_limits.h"
+#include "media_packet.h"
+#include "notifier.h"
+
+namespace foscam_hd {
+
+// Single writer, multiple reader packet ring. Packets are stored once and
+// shared by reference; each reader only keeps a cursor into the ring.
+//
+// Readers start at the next keyframe packet pushed, or at the most recent
+// keyframe still in the ring to replay its GOP. A reader that falls more
+// than the ring capacity behind, or further behind than its limits allow,
+// skips ahead to a keyframe packet.
+class BroadcastRing {
+ public:
+  enum class Start {
+    NEXT_KEYFRAME,
+    LAST_KEYFRAME
+  };
+
+  class Reader {
+   public:
+    explicit Reader(BroadcastRing & ring, Start start = Start::NEXT_KEYFRAME);
+    ~Reader();
+
+    // Notifier signalled on every push, for consumers waiting on several
+    // inputs at once
+    void set_notifier(Notifier * notifier);
+    void set_limits(const BufferLimits & limits);
+    DropStats drop_stats() const;
+
+    size_t read_available() const;
+    size_t try_read(uint8_t * data, size_t max_size);
+    size_t wait_and_read(uint8_t * data, size_t max_size,
+                         std::chrono::milliseconds timeout);
+
+    // Whole packet reads, for consumers that work on access units rather
+    // than bytes. Not to be mixed with the byte reads above.
+    MediaPacketPtr try_read_packet();
+
+   private:
+    size_t CopyOut(uint8_t * data, size_t max_size);
+    bool FetchLocked();
+    void EnforceLimitsLocked();
+    void SkipToLocked(uint64_t sequence, bool count_drops);
+
+    BroadcastRing & ring_;
+    uint64_t sequence_;
+    uint64_t stream_offset_;
+    MediaPacketPtr current_;
+    size_t current_offset_;
+    Notifier * notifier_;
+    BufferLimits limits_;
+    DropStats drop_stats_;
+    bool resync_;
+    bool started_;
+
+    Reader(const Reader &) = delete;
+    Reader & operator=(const Reader &) = delete;
+  };
+
+  explicit BroadcastRing(size_t capacity);
+
+  void push(MediaPacketPtr packet);
+
+ private:
+  uint64_t OldestLocked() const;
+  uint64_t StreamOffsetLocked(uint64_t sequence) const;
+
+  struct Slot {
+    MediaPacketPtr packet;
+    uint64_t stream_offset;
+  };
+
+  std::vector<Slot> slots_;
+  std::vector<Notifier *> notifiers_;
+  uint64_t head_;
+  uint64_t stream_size_;
+  mutable std::mutex mutex_;
+  std::condition_variable data_available_;
+
+  BroadcastRing(const BroadcastRing &) = delete;
+  BroadcastRing & operator=(const BroadcastRing &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // BROADCAST_RING_H_
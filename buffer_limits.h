@@ -0,0 +1,28 @@
+#ifndef BUFFER_LIMITS_H_
+#define BUFFER_LIMITS_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace foscam_hd {
+
+// Per-viewer buffering budget. A zero value leaves that dimension unbounded.
+struct BufferLimits {
+  size_t max_bytes = 0;
+  std::chrono::milliseconds max_delay{0};
+
+  bool bounded() const {
+    return max_bytes != 0 || max_delay.count() != 0;
+  }
+};
+
+struct DropStats {
+  uint64_t drop_events = 0;
+  uint64_t dropped_packets = 0;
+  uint64_t dropped_bytes = 0;
+};
+
+}  // namespace foscam_hd
+
+#endif  // BUFFER_LIMITS_H_
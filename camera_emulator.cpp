@@ -0,0 +1,882 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "foscam_protocol.h"
+#include "h264_parser.h"
+
+namespace baio = boost::asio;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Sent as is to every connection, so shared by all of them
+typedef std::shared_ptr<const std::vector<uint8_t>> Message;
+
+const unsigned int DEFAULT_CAMERAS = 1;
+const unsigned short DEFAULT_PORT = 8800;
+const unsigned int DEFAULT_FRAMERATE = 30;
+
+// The camera sends 8 kHz mono PCM in 40 ms packets
+const unsigned int PCM_SAMPLE_RATE = 8000;
+const unsigned int PCM_PACKET_SAMPLES = 320;
+const std::chrono::microseconds AUDIO_PACKET_DURATION(
+    1000000LL * PCM_PACKET_SAMPLES / PCM_SAMPLE_RATE);
+
+// Stream sent when no files are given: a GOP per second of 8 KiB frames
+// and a tone
+const unsigned int SYNTHETIC_SECONDS = 10;
+const size_t SYNTHETIC_FRAME_SIZE = 8 * 1024;
+const double SYNTHETIC_TONE_HZ = 440.0;
+const double SYNTHETIC_AMPLITUDE = 8000;
+
+// 1280x720 high profile SPS and a PPS
+const uint8_t SYNTHETIC_PARAMETER_SETS[] = {
+  0, 0, 0, 1, 0x67, 0x64, 0x00, 0x1f, 0xac, 0xd9, 0x40, 0x50, 0x05, 0xbb,
+  0x01, 0x10, 0x00, 0x00, 0x03, 0x00, 0x10, 0x00, 0x00, 0x03, 0x03, 0x20,
+  0xf1, 0x83, 0x19, 0x60,
+  0, 0, 0, 1, 0x68, 0xeb, 0xe3, 0xcb, 0x22, 0xc0
+};
+
+// Further behind in real time, a connection loses frames up to the next
+// keyframe like on the camera
+const size_t MAX_QUEUED_MESSAGES = 64;
+
+// Messages queued at once when sending flat out
+const size_t FLAT_OUT_BATCH = 8;
+
+// Commands are a few hundred bytes
+const size_t MAX_COMMAND_SIZE = 4096;
+
+const std::chrono::seconds STATS_INTERVAL(10);
+
+constexpr size_t HEADER_SIZE = foscam_api::wire_size<foscam_api::Header>();
+
+struct EmulatorConfig {
+  unsigned int cameras = DEFAULT_CAMERAS;
+  std::string address = "127.0.0.1";
+  unsigned short port = DEFAULT_PORT;
+  unsigned int threads = std::max(1u, std::thread::hardware_concurrency());
+  unsigned int framerate = DEFAULT_FRAMERATE;
+  // Paced at the framerate, otherwise as fast as the connection takes it
+  bool realtime = true;
+  std::string video_path;
+  std::string audio_path;
+  std::string user = "hugcam";
+  std::string password = "password";
+};
+
+struct Media {
+  // VIDEO_DATA messages, one access unit each
+  std::vector<Message> video;
+  std::vector<bool> keyframes;
+  // AUDIO_DATA messages
+  std::vector<Message> audio;
+};
+
+// Totals over all cameras
+struct EmulatorStats {
+  std::atomic<uint64_t> connections{0};
+  std::atomic<uint64_t> cgi_requests{0};
+  std::atomic<uint64_t> video_frames{0};
+  std::atomic<uint64_t> audio_packets{0};
+  std::atomic<uint64_t> dropped_frames{0};
+  std::atomic<uint64_t> bytes{0};
+  // Worst delay of a timer behind the frame it was due for
+  std::atomic<int64_t> max_lateness_us{0};
+};
+
+void UpdateMax(std::atomic<int64_t> & max, int64_t value) {
+  int64_t current = max.load();
+  while (value > current && !max.compare_exchange_weak(current, value)) {
+  }
+}
+
+bool ReadFile(const std::string & path, std::vector<uint8_t> & data) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    return false;
+  }
+  data.assign(std::istreambuf_iterator<char>(file),
+              std::istreambuf_iterator<char>());
+  return true;
+}
+
+// Header and payload in one buffer
+Message MakeMessage(foscam_api::Command type, const uint8_t * payload,
+                    size_t size) {
+  foscam_api::Header header;
+  header.type = type;
+  header.size = size;
+
+  auto message = std::make_shared<std::vector<uint8_t>>(HEADER_SIZE + size);
+  foscam_api::Encode(header, message->data());
+  memcpy(message->data() + HEADER_SIZE, payload, size);
+  return message;
+}
+
+template<typename T>
+Message MakeCommand(foscam_api::Command type, const T & command) {
+  return std::make_shared<std::vector<uint8_t>>(
+      foscam_api::EncodeCommand(type, command));
+}
+
+// The camera sends an access unit per message. A new one starts at the
+// first NAL unit that is not a slice after a slice, or at a slice with a
+// first_mb_in_slice of 0.
+std::vector<std::vector<uint8_t>> SplitAccessUnits(
+    const std::vector<uint8_t> & stream) {
+  static const uint8_t start_code[] = {0, 0, 0, 1};
+  std::vector<std::vector<uint8_t>> units;
+  std::vector<uint8_t> unit;
+  bool has_slice = false;
+  foscam_hd::ForEachNalUnit(
+      stream.data(), stream.size(), [&](const foscam_hd::NalUnit & nal) {
+        bool slice = nal.type == foscam_hd::NalUnitType::SLICE ||
+            nal.type == foscam_hd::NalUnitType::IDR_SLICE;
+        bool starts_picture = !slice || (nal.size > 1 && nal.data[1] & 0x80);
+        if (has_slice && starts_picture) {
+          units.push_back(std::move(unit));
+          unit.clear();
+          has_slice = false;
+        }
+        unit.insert(unit.end(), start_code, start_code + sizeof(start_code));
+        unit.insert(unit.end(), nal.data, nal.data + nal.size);
+        has_slice |= slice;
+      });
+  if (has_slice) {
+    units.push_back(std::move(unit));
+  }
+  return units;
+}
+
+std::vector<std::vector<uint8_t>> MakeSyntheticVideo(unsigned int framerate) {
+  std::vector<std::vector<uint8_t>> units;
+  for (unsigned int idx = 0; idx < SYNTHETIC_SECONDS * framerate; idx++) {
+    bool keyframe = idx % framerate == 0;
+    std::vector<uint8_t> unit;
+    if (keyframe) {
+      unit.assign(SYNTHETIC_PARAMETER_SETS,
+                  SYNTHETIC_PARAMETER_SETS + sizeof(SYNTHETIC_PARAMETER_SETS));
+    }
+    const uint8_t slice_header[] = {0, 0, 0, 1,
+                                    static_cast<uint8_t>(keyframe ? 0x65 :
+                                                                    0x41)};
+    unit.insert(unit.end(), slice_header,
+                slice_header + sizeof(slice_header));
+    unit.resize(unit.size() + SYNTHETIC_FRAME_SIZE, 0x80);
+    units.push_back(std::move(unit));
+  }
+  return units;
+}
+
+std::vector<uint8_t> MakeSyntheticAudio() {
+  std::vector<uint8_t> pcm(SYNTHETIC_SECONDS * PCM_SAMPLE_RATE *
+                           sizeof(int16_t));
+  for (size_t idx = 0; idx < pcm.size() / sizeof(int16_t); idx++) {
+    int16_t sample = static_cast<int16_t>(
+        SYNTHETIC_AMPLITUDE *
+        sin(2 * M_PI * SYNTHETIC_TONE_HZ * idx / PCM_SAMPLE_RATE));
+    memcpy(pcm.data() + idx * sizeof(int16_t), &sample, sizeof(sample));
+  }
+  return pcm;
+}
+
+bool LoadMedia(const EmulatorConfig & config, Media & media) {
+  std::vector<std::vector<uint8_t>> units;
+  if (config.video_path.empty()) {
+    units = MakeSyntheticVideo(config.framerate);
+  } else {
+    std::vector<uint8_t> stream;
+    if (!ReadFile(config.video_path, stream)) {
+      std::cerr << "Failed to read " << config.video_path << std::endl;
+      return false;
+    }
+    units = SplitAccessUnits(stream);
+  }
+  for (auto & unit : units) {
+    media.video.push_back(MakeMessage(foscam_api::Command::VIDEO_DATA,
+                                      unit.data(), unit.size()));
+    media.keyframes.push_back(
+        foscam_hd::ParseAccessUnit(unit.data(), unit.size()).keyframe);
+  }
+  if (media.video.empty()) {
+    std::cerr << "No access units in " << config.video_path << std::endl;
+    return false;
+  }
+
+  // Raw 16 bit little endian samples
+  std::vector<uint8_t> pcm;
+  if (config.audio_path.empty()) {
+    pcm = MakeSyntheticAudio();
+  } else if (!ReadFile(config.audio_path, pcm)) {
+    std::cerr << "Failed to read " << config.audio_path << std::endl;
+    return false;
+  }
+  const size_t audio_data_header_size =
+      foscam_api::wire_size<foscam_api::AudioDataHeader>();
+  const size_t packet_size = PCM_PACKET_SAMPLES * sizeof(int16_t);
+  std::vector<uint8_t> payload(audio_data_header_size + packet_size);
+  foscam_api::Encode(foscam_api::AudioDataHeader(), payload.data());
+  for (size_t offset = 0; offset + packet_size <= pcm.size();
+       offset += packet_size) {
+    memcpy(payload.data() + audio_data_header_size, pcm.data() + offset,
+           packet_size);
+    media.audio.push_back(MakeMessage(foscam_api::Command::AUDIO_DATA,
+                                      payload.data(), payload.size()));
+  }
+  if (media.audio.empty()) {
+    std::cerr << "Less than a packet of audio in " << config.audio_path
+              << std::endl;
+    return false;
+  }
+  return true;
+}
+
+template<size_t N>
+std::string ToString(const foscam_api::FixedString<N> & str) {
+  return std::string(str.str, strnlen(str.str, N));
+}
+
+// SERVERPUSH connection: answers the commands and streams the media once it
+// is turned on. Handlers run on the strand, as reads and writes overlap.
+class PushSession : public std::enable_shared_from_this<PushSession> {
+ public:
+  PushSession(baio::io_service & io_service, baio::ip::tcp::socket socket,
+              baio::streambuf & received, const EmulatorConfig & config,
+              const Media & media, EmulatorStats & stats)
+      : socket_(std::move(socket)), strand_(io_service), timer_(io_service),
+        config_(config), media_(media), stats_(stats), writing_(0),
+        video_on_(false), audio_on_(false), dropping_(false), closed_(false),
+        video_index_(0), audio_index_(0) {
+    // Commands sent along with the request line
+    size_t size = received.size();
+    baio::buffer_copy(input_.prepare(size), received.data());
+    input_.commit(size);
+    stats_.connections++;
+  }
+
+  ~PushSession() {
+    stats_.connections--;
+  }
+
+  void Start() {
+    strand_.dispatch([this, self = shared_from_this()]() {
+      ReadCommands();
+    });
+  }
+
+ private:
+  void ReadCommands() {
+    while (!closed_) {
+      size_t needed = HEADER_SIZE;
+      foscam_api::Header header;
+      if (input_.size() >= HEADER_SIZE) {
+        try {
+          header = foscam_api::Decode<foscam_api::Header>(
+              baio::buffer_cast<const uint8_t *>(input_.data()), HEADER_SIZE);
+        } catch (foscam_hd::ProtocolException & ex) {
+          std::cerr << ex.what() << std::endl;
+          Close();
+          return;
+        }
+        if (header.size > MAX_COMMAND_SIZE) {
+          std::cerr << "Command too large: " << header.size << std::endl;
+          Close();
+          return;
+        }
+        needed += header.size;
+      }
+
+      if (input_.size() < needed) {
+        baio::async_read(
+            socket_, input_, baio::transfer_exactly(needed - input_.size()),
+            strand_.wrap([this, self = shared_from_this()](
+                boost::system::error_code ec, std::size_t) {
+              if (!ec) {
+                ReadCommands();
+              } else {
+                Close();
+              }
+            }));
+        return;
+      }
+
+      HandleCommand(header, baio::buffer_cast<const uint8_t *>(
+          input_.data()) + HEADER_SIZE);
+      input_.consume(needed);
+    }
+  }
+
+  void HandleCommand(const foscam_api::Header & header,
+                     const uint8_t * payload) {
+    try {
+      switch (header.type) {
+        case foscam_api::Command::VIDEO_ON_REQUEST: {
+          auto request = foscam_api::Decode<foscam_api::VideoOnRequest>(
+              payload, header.size);
+          foscam_api::VideoOnReply reply;
+          reply.failed = !CheckCredentials(request.username,
+                                           request.password);
+          Queue(MakeCommand(foscam_api::Command::VIDEO_ON_REPLY, reply));
+          if (!reply.failed && !video_on_) {
+            video_on_ = true;
+            video_start_ = Clock::now();
+            SendDue();
+          }
+          Write();
+          break;
+        }
+
+        case foscam_api::Command::AUDIO_ON_REQUEST: {
+          auto request = foscam_api::Decode<foscam_api::AudioOnRequest>(
+              payload, header.size);
+          foscam_api::AudioOnReply reply;
+          reply.failed = !CheckCredentials(request.username,
+                                           request.password);
+          Queue(MakeCommand(foscam_api::Command::AUDIO_ON_REPLY, reply));
+          if (!reply.failed && !audio_on_) {
+            audio_on_ = true;
+            audio_start_ = Clock::now();
+            SendDue();
+          }
+          Write();
+          break;
+        }
+
+        case foscam_api::Command::CLOSE_CONNECTION:
+          Close();
+          break;
+
+        default:
+          break;
+      }
+    } catch (foscam_hd::ProtocolException & ex) {
+      std::cerr << ex.what() << std::endl;
+      Close();
+    }
+  }
+
+  template<size_t N>
+  bool CheckCredentials(const foscam_api::FixedString<N> & user,
+                        const foscam_api::FixedString<N> & password) const {
+    return ToString(user) == config_.user &&
+        ToString(password) == config_.password;
+  }
+
+  Clock::time_point VideoDue(uint64_t index) const {
+    return video_start_ + std::chrono::microseconds(
+        index * 1000000 / config_.framerate);
+  }
+
+  Clock::time_point AudioDue(uint64_t index) const {
+    return audio_start_ + index * AUDIO_PACKET_DURATION;
+  }
+
+  // Queues what is due and waits for the next frame or packet. Flat out,
+  // queues the next batch in media order instead.
+  void SendDue() {
+    if (closed_) {
+      return;
+    }
+
+    if (!config_.realtime) {
+      while (queue_.size() < FLAT_OUT_BATCH && (video_on_ || audio_on_)) {
+        bool audio_first = audio_on_ &&
+            (!video_on_ || AudioDue(audio_index_) - audio_start_ <
+                           VideoDue(video_index_) - video_start_);
+        if (audio_first) {
+          QueueAudioPacket();
+        } else {
+          QueueVideoFrame();
+        }
+      }
+      Write();
+      return;
+    }
+
+    auto now = Clock::now();
+    auto next = Clock::time_point::max();
+    if (video_on_) {
+      auto due = VideoDue(video_index_);
+      if (due <= now) {
+        UpdateMax(stats_.max_lateness_us,
+                  std::chrono::duration_cast<std::chrono::microseconds>(
+                      now - due).count());
+      }
+      while (due <= now) {
+        QueueVideoFrame();
+        due = VideoDue(video_index_);
+      }
+      next = due;
+    }
+    if (audio_on_) {
+      auto due = AudioDue(audio_index_);
+      while (due <= now) {
+        QueueAudioPacket();
+        due = AudioDue(audio_index_);
+      }
+      next = std::min(next, due);
+    }
+    Write();
+
+    if (next != Clock::time_point::max()) {
+      timer_.expires_at(next);
+      timer_.async_wait(strand_.wrap(
+          [this, self = shared_from_this()](boost::system::error_code ec) {
+            if (!ec) {
+              SendDue();
+            }
+          }));
+    }
+  }
+
+  void QueueVideoFrame() {
+    size_t idx = video_index_++ % media_.video.size();
+    if (queue_.size() >= MAX_QUEUED_MESSAGES ||
+        (dropping_ && !media_.keyframes[idx])) {
+      dropping_ = true;
+      stats_.dropped_frames++;
+      return;
+    }
+    dropping_ = false;
+    Queue(media_.video[idx]);
+    stats_.video_frames++;
+  }
+
+  void QueueAudioPacket() {
+    size_t idx = audio_index_++ % media_.audio.size();
+    if (queue_.size() >= MAX_QUEUED_MESSAGES) {
+      return;
+    }
+    Queue(media_.audio[idx]);
+    stats_.audio_packets++;
+  }
+
+  void Queue(Message message) {
+    queue_.push_back(std::move(message));
+  }
+
+  // Everything queued goes out in one gathered write
+  void Write() {
+    if (closed_ || writing_ || queue_.empty()) {
+      return;
+    }
+
+    write_buffers_.clear();
+    for (auto & message : queue_) {
+      write_buffers_.push_back(baio::buffer(*message));
+    }
+    writing_ = queue_.size();
+
+    baio::async_write(
+        socket_, write_buffers_,
+        strand_.wrap([this, self = shared_from_this()](
+            boost::system::error_code ec, std::size_t length) {
+          if (ec) {
+            Close();
+            return;
+          }
+          stats_.bytes += length;
+          queue_.erase(queue_.begin(), queue_.begin() + writing_);
+          writing_ = 0;
+          if (!config_.realtime) {
+            SendDue();
+          }
+          Write();
+        }));
+  }
+
+  void Close() {
+    if (closed_) {
+      return;
+    }
+    closed_ = true;
+    boost::system::error_code ec;
+    timer_.cancel(ec);
+    socket_.close(ec);
+  }
+
+  baio::ip::tcp::socket socket_;
+  baio::io_service::strand strand_;
+  baio::steady_timer timer_;
+  const EmulatorConfig & config_;
+  const Media & media_;
+  EmulatorStats & stats_;
+
+  baio::streambuf input_;
+  std::deque<Message> queue_;
+  std::vector<baio::const_buffer> write_buffers_;
+  // Messages at the front of the queue being written
+  size_t writing_;
+
+  bool video_on_;
+  bool audio_on_;
+  bool dropping_;
+  bool closed_;
+  Clock::time_point video_start_;
+  Clock::time_point audio_start_;
+  // Next frame and packet, counting from when each was turned on
+  uint64_t video_index_;
+  uint64_t audio_index_;
+
+  PushSession(const PushSession &) = delete;
+  PushSession & operator=(const PushSession &) = delete;
+};
+
+// Reads the request line and headers, then becomes a push session or
+// answers a CGI command like the camera's web server.
+class Connection : public std::enable_shared_from_this<Connection> {
+ public:
+  Connection(baio::io_service & io_service, baio::ip::tcp::socket socket,
+             const EmulatorConfig & config, const Media & media,
+             EmulatorStats & stats)
+      : io_service_(io_service), socket_(std::move(socket)), config_(config),
+        media_(media), stats_(stats) {
+  }
+
+  void Start() {
+    baio::async_read_until(
+        socket_, request_, "\r\n\r\n",
+        [this, self = shared_from_this()](boost::system::error_code ec,
+                                          std::size_t length) {
+          if (!ec) {
+            HandleRequest(length);
+          }
+        });
+  }
+
+ private:
+  void HandleRequest(size_t length) {
+    auto begin = baio::buffers_begin(request_.data());
+    std::istringstream head(std::string(begin, begin + length));
+    request_.consume(length);
+    std::string method;
+    std::string target;
+    head >> method >> target;
+
+    if (method == "SERVERPUSH") {
+      std::make_shared<PushSession>(io_service_, std::move(socket_),
+                                    request_, config_, media_, stats_)
+          ->Start();
+      return;
+    }
+
+    stats_.cgi_requests++;
+    if (method != "GET" || target.compare(0, CGI_PATH.size(), CGI_PATH)) {
+      Respond("404 Not Found", "");
+      return;
+    }
+    Respond("200 OK", ExecuteCgi(ParseQuery(target.substr(CGI_PATH.size()))));
+  }
+
+  static std::map<std::string, std::string> ParseQuery(
+      const std::string & query) {
+    std::map<std::string, std::string> params;
+    std::istringstream query_stream(query);
+    std::string param;
+    while (std::getline(query_stream, param, '&')) {
+      size_t separator = param.find('=');
+      if (separator != std::string::npos) {
+        params[param.substr(0, separator)] = param.substr(separator + 1);
+      }
+    }
+    return params;
+  }
+
+  std::string ExecuteCgi(const std::map<std::string, std::string> & params) {
+    auto param = [&params](const std::string & name) {
+      auto found = params.find(name);
+      return found != params.end() ? found->second : std::string();
+    };
+
+    std::ostringstream body;
+    body << "<CGI_Result>\n";
+    if (param("usr") != config_.user || param("pwd") != config_.password) {
+      body << "    <result>-2</result>\n";
+    } else if (param("cmd") == "getMainVideoStreamType") {
+      body << "    <result>0</result>\n"
+           << "    <streamType>0</streamType>\n";
+    } else if (param("cmd") == "getVideoStreamParam") {
+      body << "    <result>0</result>\n";
+      for (unsigned int type = 0; type < 4; type++) {
+        body << "    <resolution" << type << ">0</resolution" << type
+             << ">\n"
+             << "    <bitRate" << type << ">2097152</bitRate" << type
+             << ">\n"
+             << "    <frameRate" << type << ">" << config_.framerate
+             << "</frameRate" << type << ">\n"
+             << "    <GOP" << type << ">" << config_.framerate << "</GOP"
+             << type << ">\n"
+             << "    <isVBR" << type << ">1</isVBR" << type << ">\n";
+      }
+    } else {
+      body << "    <result>-1</result>\n";
+    }
+    body << "</CGI_Result>\n";
+    return body.str();
+  }
+
+  // HTTP/1.0, the body ends when the connection closes
+  void Respond(const std::string & status, const std::string & body) {
+    response_ = "HTTP/1.0 " + status + "\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: " + std::to_string(body.size()) + "\r\n"
+        "\r\n" + body;
+    baio::async_write(
+        socket_, baio::buffer(response_),
+        [this, self = shared_from_this()](boost::system::error_code,
+                                          std::size_t) {
+          boost::system::error_code ec;
+          socket_.shutdown(baio::ip::tcp::socket::shutdown_both, ec);
+          socket_.close(ec);
+        });
+  }
+
+  static const std::string CGI_PATH;
+
+  baio::io_service & io_service_;
+  baio::ip::tcp::socket socket_;
+  const EmulatorConfig & config_;
+  const Media & media_;
+  EmulatorStats & stats_;
+  baio::streambuf request_;
+  std::string response_;
+
+  Connection(const Connection &) = delete;
+  Connection & operator=(const Connection &) = delete;
+};
+
+const std::string Connection::CGI_PATH = "/cgi-bin/CGIProxy.fcgi?";
+
+// The low-level protocol and the CGI commands share a port, as on the camera
+class Camera {
+ public:
+  Camera(baio::io_service & io_service,
+         const baio::ip::tcp::endpoint & endpoint,
+         const EmulatorConfig & config, const Media & media,
+         EmulatorStats & stats)
+      : io_service_(io_service), acceptor_(io_service, endpoint),
+        socket_(io_service), config_(config), media_(media), stats_(stats) {
+  }
+
+  void Accept() {
+    acceptor_.async_accept(socket_, [this](boost::system::error_code ec) {
+      if (ec == baio::error::operation_aborted) {
+        return;
+      }
+      if (!ec) {
+        socket_.set_option(baio::ip::tcp::no_delay(true));
+        std::make_shared<Connection>(io_service_, std::move(socket_), config_,
+                                     media_, stats_)->Start();
+      }
+      socket_ = baio::ip::tcp::socket(io_service_);
+      Accept();
+    });
+  }
+
+ private:
+  baio::io_service & io_service_;
+  baio::ip::tcp::acceptor acceptor_;
+  baio::ip::tcp::socket socket_;
+  const EmulatorConfig & config_;
+  const Media & media_;
+  EmulatorStats & stats_;
+
+  Camera(const Camera &) = delete;
+  Camera & operator=(const Camera &) = delete;
+};
+
+// Prints the rates over the last interval
+class StatsReporter {
+ public:
+  StatsReporter(baio::io_service & io_service, EmulatorStats & stats)
+      : timer_(io_service), stats_(stats), video_frames_(0),
+        audio_packets_(0), dropped_frames_(0), bytes_(0) {
+  }
+
+  void Start() {
+    timer_.expires_from_now(STATS_INTERVAL);
+    timer_.async_wait([this](boost::system::error_code ec) {
+      if (!ec) {
+        Report();
+        Start();
+      }
+    });
+  }
+
+ private:
+  void Report() {
+    double seconds = std::chrono::duration<double>(STATS_INTERVAL).count();
+    uint64_t video_frames = stats_.video_frames;
+    uint64_t audio_packets = stats_.audio_packets;
+    uint64_t dropped_frames = stats_.dropped_frames;
+    uint64_t bytes = stats_.bytes;
+    int64_t max_lateness_us = stats_.max_lateness_us.exchange(0);
+
+    std::cout << stats_.connections << " connections, "
+              << stats_.cgi_requests << " CGI requests, " << std::fixed
+              << std::setprecision(1)
+              << (video_frames - video_frames_) / seconds << " frames/s, "
+              << (audio_packets - audio_packets_) / seconds
+              << " audio packets/s, "
+              << (bytes - bytes_) / seconds / (1024 * 1024) << " MiB/s, "
+              << dropped_frames - dropped_frames_ << " frames dropped, "
+              << "max lateness " << max_lateness_us / 1000.0 << " ms"
+              << std::endl;
+
+    video_frames_ = video_frames;
+    audio_packets_ = audio_packets;
+    dropped_frames_ = dropped_frames;
+    bytes_ = bytes;
+  }
+
+  baio::steady_timer timer_;
+  EmulatorStats & stats_;
+  uint64_t video_frames_;
+  uint64_t audio_packets_;
+  uint64_t dropped_frames_;
+  uint64_t bytes_;
+
+  StatsReporter(const StatsReporter &) = delete;
+  StatsReporter & operator=(const StatsReporter &) = delete;
+};
+
+void PrintUsage(const char * name) {
+  std::cerr << "Usage: " << name << " [options]\n"
+            << "  --cameras N      cameras to emulate, on consecutive ports ("
+            << DEFAULT_CAMERAS << ")\n"
+            << "  --address ADDR   address to listen on (127.0.0.1)\n"
+            << "  --port PORT      port of the first camera (" << DEFAULT_PORT
+            << ")\n"
+            << "  --threads N      I/O threads (one per core)\n"
+            << "  --video FILE     H.264 Annex-B stream (synthetic frames)\n"
+            << "  --audio FILE     8 kHz mono 16 bit PCM (a tone)\n"
+            << "  --framerate N    video frames per second ("
+            << DEFAULT_FRAMERATE << ")\n"
+            << "  --flat-out       send as fast as each connection reads\n"
+            << "  --user USER      expected user name (hugcam)\n"
+            << "  --password PWD   expected password (password)" << std::endl;
+}
+
+bool ParseArguments(int argc, char * argv[], EmulatorConfig & config) {
+  try {
+    for (int idx = 1; idx < argc; idx++) {
+      std::string arg = argv[idx];
+      if (arg == "--flat-out") {
+        config.realtime = false;
+        continue;
+      }
+      if (idx + 1 == argc) {
+        return false;
+      }
+      std::string value = argv[++idx];
+      if (arg == "--cameras") {
+        config.cameras = std::stoul(value);
+      } else if (arg == "--address") {
+        config.address = value;
+      } else if (arg == "--port") {
+        config.port = std::stoul(value);
+      } else if (arg == "--threads") {
+        config.threads = std::stoul(value);
+      } else if (arg == "--video") {
+        config.video_path = value;
+      } else if (arg == "--audio") {
+        config.audio_path = value;
+      } else if (arg == "--framerate") {
+        config.framerate = std::stoul(value);
+      } else if (arg == "--user") {
+        config.user = value;
+      } else if (arg == "--password") {
+        config.password = value;
+      } else {
+        return false;
+      }
+    }
+  } catch (std::exception &) {
+    return false;
+  }
+  return config.cameras > 0 && config.threads > 0 && config.framerate > 0 &&
+      config.port + config.cameras - 1 <= 65535;
+}
+
+}  // namespace
+
+// Emulates Foscam cameras on localhost so the server can be run and load
+// tested without one. Each camera listens on its own port.
+int main(int argc, char * argv[]) {
+  EmulatorConfig config;
+  if (!ParseArguments(argc, argv, config)) {
+    PrintUsage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  Media media;
+  if (!LoadMedia(config, media)) {
+    return EXIT_FAILURE;
+  }
+
+  baio::io_service io_service;
+  EmulatorStats stats;
+  std::vector<std::unique_ptr<Camera>> cameras;
+  try {
+    auto address = baio::ip::address::from_string(config.address);
+    for (unsigned int idx = 0; idx < config.cameras; idx++) {
+      cameras.emplace_back(new Camera(
+          io_service, baio::ip::tcp::endpoint(address, config.port + idx),
+          config, media, stats));
+      cameras.back()->Accept();
+    }
+  } catch (std::exception & ex) {
+    std::cerr << "Failed to listen: " << ex.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  StatsReporter reporter(io_service, stats);
+  reporter.Start();
+
+  std::cout << "Emulating " << config.cameras << " cameras on "
+            << config.address << ":" << config.port << "-"
+            << config.port + config.cameras - 1 << ", "
+            << media.video.size() << " frames and " << media.audio.size()
+            << " audio packets looped "
+            << (config.realtime ? "in real time" : "flat out") << std::endl;
+
+  std::vector<std::thread> threads;
+  for (unsigned int idx = 0; idx < config.threads; idx++) {
+    threads.emplace_back([&io_service]() {
+      try {
+        io_service.run();
+      } catch (std::exception & ex) {
+        std::cerr << "Failure occured while running service thread: "
+                  << ex.what() << std::endl;
+      }
+    });
+  }
+
+  getchar();
+  io_service.stop();
+  for (auto & thread : threads) {
+    thread.join();
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,214 @@
+#include "camera_manager.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+
+#include <boost/property_tree/ini_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace bpt = boost::property_tree;
+
+namespace {
+
+const char DEFAULT_RECORDINGS_DIRECTORY[] = "recordings";
+const uint64_t DEFAULT_RECORDING_MAX_GIB = 16;
+
+// Bounds the whole bring-up of a camera, an unreachable one included
+const std::chrono::milliseconds START_TIMEOUT(10000);
+
+}  // namespace
+
+namespace foscam_hd {
+
+CameraManagerException::CameraManagerException(const std::string & what)
+    : what_("CameraManagerException: " + what) {
+}
+
+const char* CameraManagerException::what() const noexcept {
+  return what_.c_str();
+}
+
+std::vector<CameraConfig> LoadCameraConfigs(const std::string & path) {
+  bpt::ptree tree;
+  try {
+    bpt::read_ini(path, tree);
+  } catch (bpt::ini_parser_error & ex) {
+    throw CameraManagerException(ex.what());
+  }
+
+  std::vector<CameraConfig> configs;
+  for (auto & section : tree) {
+    CameraConfig config;
+    config.id = section.first;
+    // Ids go into URLs and JSON as they are
+    if (config.id.empty() ||
+        !std::all_of(config.id.begin(), config.id.end(), [](char c) {
+          return isalnum(static_cast<unsigned char>(c)) || c == '-' ||
+              c == '_';
+        })) {
+      throw CameraManagerException("Invalid camera id \"" + config.id +
+                                   "\" in " + path);
+    }
+    for (auto & other : configs) {
+      if (other.id == config.id) {
+        throw CameraManagerException("Duplicate camera id \"" + config.id +
+                                     "\" in " + path);
+      }
+    }
+
+    try {
+      const bpt::ptree & camera = section.second;
+      config.host = camera.get<std::string>("host");
+      config.port = camera.get<unsigned int>("port", config.port);
+      config.user = camera.get<std::string>("user");
+      config.password = camera.get<std::string>("password");
+      config.record = camera.get<bool>("record", config.record);
+      config.recorder.directory = camera.get<std::string>(
+          "recording_directory",
+          std::string(DEFAULT_RECORDINGS_DIRECTORY) + "/" + config.id);
+      config.recorder.max_bytes = camera.get<uint64_t>(
+          "recording_max_gib", DEFAULT_RECORDING_MAX_GIB) << 30;
+      config.recorder.event_triggered = camera.get<bool>(
+          "event_triggered", config.recorder.event_triggered);
+    } catch (bpt::ptree_error & ex) {
+      throw CameraManagerException("Camera " + config.id + " in " + path +
+                                   ": " + ex.what());
+    }
+    configs.push_back(config);
+  }
+  return configs;
+}
+
+CameraManager::CameraManager(const std::vector<CameraConfig> & configs,
+                             WorkerPool & worker_pool, size_t thread_count)
+    : next_io_service_(0) {
+  if (thread_count == 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // No more threads than cameras, the others would have nothing to do
+  thread_count = std::max<size_t>(1, std::min(thread_count, configs.size()));
+
+  for (size_t idx = 0; idx < thread_count; idx++) {
+    io_services_.emplace_back(new boost::asio::io_service(1));
+    work_.emplace_back(
+        new boost::asio::io_service::work(*io_services_.back()));
+  }
+  for (auto & io_service : io_services_) {
+    threads_.emplace_back([&io_service]() {
+      // Cameras handle their own protocol errors, this only keeps a bug in
+      // one handler from stopping the thread serving the others
+      for (;;) {
+        try {
+          io_service->run();
+          break;
+        } catch (std::exception & ex) {
+          std::cerr << "Failure occured while running service thread: "
+                    << ex.what() << std::endl;
+        }
+      }
+    });
+  }
+
+  // All cameras are brought up at once on the threads started above, so
+  // startup takes about as long as the slowest one
+  std::vector<std::shared_ptr<Foscam>> cams;
+  for (auto & config : configs) {
+    cams.push_back(std::make_shared<Foscam>(
+        config.host, config.port, time(NULL), config.user, config.password,
+        NextIoService(), worker_pool));
+  }
+
+  std::mutex start_mutex;
+  std::condition_variable start_cond;
+  std::vector<std::exception_ptr> errors(cams.size());
+  size_t pending = cams.size();
+  for (size_t idx = 0; idx < cams.size(); idx++) {
+    cams[idx]->Start(START_TIMEOUT, [&, idx](std::exception_ptr error) {
+      std::lock_guard<std::mutex> lock(start_mutex);
+      errors[idx] = error;
+      pending--;
+      start_cond.notify_one();
+    });
+  }
+  {
+    std::unique_lock<std::mutex> lock(start_mutex);
+    start_cond.wait(lock, [&pending]() { return pending == 0; });
+  }
+
+  for (size_t idx = 0; idx < cams.size(); idx++) {
+    try {
+      if (errors[idx]) {
+        std::rethrow_exception(errors[idx]);
+      }
+      AddCamera(configs[idx], cams[idx]);
+    } catch (std::exception & ex) {
+      std::cerr << "Failed to start camera " << configs[idx].id << ": "
+                << ex.what() << std::endl;
+    }
+  }
+}
+
+CameraManager::~CameraManager() {
+  for (auto & id : ids_) {
+    cameras_[id]->Disconnect();
+  }
+  // The threads return once the connections are closed
+  work_.clear();
+  for (auto & thread : threads_) {
+    thread.join();
+  }
+}
+
+std::shared_ptr<Foscam> CameraManager::camera(const std::string & id) const {
+  auto found = cameras_.find(id);
+  return found != cameras_.end() ? found->second : nullptr;
+}
+
+std::shared_ptr<Foscam> CameraManager::default_camera() const {
+  return ids_.empty() ? nullptr : camera(ids_.front());
+}
+
+const std::vector<std::string> & CameraManager::ids() const {
+  return ids_;
+}
+
+void CameraManager::AddCamera(const CameraConfig & config,
+                              std::shared_ptr<Foscam> cam) {
+  if (config.record) {
+    try {
+      // The default directory is one level below the shared one
+      size_t parent_end = config.recorder.directory.rfind('/');
+      if (parent_end != std::string::npos && parent_end > 0) {
+        std::string parent = config.recorder.directory.substr(0, parent_end);
+        if (mkdir(parent.c_str(), 0755) != 0 && errno != EEXIST) {
+          throw CameraManagerException("Failed to create " + parent + ": " +
+                                       strerror(errno));
+        }
+      }
+      cam->StartRecording(config.recorder);
+    } catch (std::exception & ex) {
+      std::cerr << "Failed to start recording camera " << config.id << ": "
+                << ex.what() << std::endl;
+    }
+  }
+
+  ids_.push_back(config.id);
+  cameras_[config.id] = cam;
+  std::cout << "Camera " << config.id << " started" << std::endl;
+}
+
+boost::asio::io_service & CameraManager::NextIoService() {
+  auto & io_service = *io_services_[next_io_service_];
+  next_io_service_ = (next_io_service_ + 1) % io_services_.size();
+  return io_service;
+}
+
+}  // namespace foscam_hd
@@ -0,0 +1,95 @@
+#ifndef CAMERA_MANAGER_H_
+#define CAMERA_MANAGER_H_
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "foscam.h"
+#include "recorder.h"
+#include "worker_pool.h"
+
+namespace foscam_hd {
+
+class CameraManagerException : public std::exception {
+ public:
+  explicit CameraManagerException(const std::string & what);
+
+  const char* what() const noexcept override;
+
+ private:
+  std::string what_;
+};
+
+struct CameraConfig {
+  // Names the camera in /camera/<id>/ URLs
+  std::string id;
+  std::string host;
+  unsigned int port = 88;
+  std::string user;
+  std::string password;
+  bool record = false;
+  RecorderConfig recorder;
+};
+
+// Reads an INI file with a section per camera, named after its id:
+//
+//   [front]
+//   host = 192.168.1.8
+//   port = 88
+//   user = admin
+//   password = secret
+//   record = true
+//   recording_directory = recordings/front
+//   recording_max_gib = 16
+//   event_triggered = false
+std::vector<CameraConfig> LoadCameraConfigs(const std::string & path);
+
+// Owns the cameras and the io_services their connections run on. There is
+// an io_service per thread, one thread per core by default, and cameras are
+// spread over them; each camera's handlers run on its own strand. The
+// receive paths of different cameras therefore share no lock, and the
+// cameras a host can take grows with its cores.
+class CameraManager {
+ public:
+  // Returns once every camera has started or failed to. Cameras that fail
+  // to start are left out, so one unreachable camera does not take down the
+  // others
+  CameraManager(const std::vector<CameraConfig> & configs,
+                WorkerPool & worker_pool, size_t thread_count = 0);
+  ~CameraManager();
+
+  // Null for an unknown id or a camera that failed to start
+  std::shared_ptr<Foscam> camera(const std::string & id) const;
+  // The first camera configured that started, for the unprefixed routes
+  std::shared_ptr<Foscam> default_camera() const;
+  // Started cameras, in configuration order
+  const std::vector<std::string> & ids() const;
+
+ private:
+  void AddCamera(const CameraConfig & config, std::shared_ptr<Foscam> cam);
+  boost::asio::io_service & NextIoService();
+
+  std::vector<std::unique_ptr<boost::asio::io_service>> io_services_;
+  // Keep run() going while a camera is between connections
+  std::vector<std::unique_ptr<boost::asio::io_service::work>> work_;
+  std::vector<std::thread> threads_;
+  size_t next_io_service_;
+
+  // Filled by the constructor only, so lookups need no lock
+  std::vector<std::string> ids_;
+  std::unordered_map<std::string, std::shared_ptr<Foscam>> cameras_;
+
+  CameraManager(const CameraManager &) = delete;
+  CameraManager & operator=(const CameraManager &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // CAMERA_MANAGER_H_
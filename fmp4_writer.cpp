@@ -0,0 +1,503 @@
+#include "fmp4_writer.h"
+
+#include <cstring>
+
+namespace {
+
+using foscam_hd::Fmp4Writer;
+using foscam_hd::Mp4BoxType;
+using foscam_hd::SequenceParameterSet;
+
+// Sample flags: sample_depends_on and sample_is_non_sync_sample
+const uint32_t KEYFRAME_SAMPLE_FLAGS = 0x02000000;
+const uint32_t DELTA_SAMPLE_FLAGS = 0x01010000;
+
+const uint32_t TFHD_DEFAULT_BASE_IS_MOOF = 0x020000;
+const uint32_t TRUN_DATA_OFFSET = 0x000001;
+const uint32_t TRUN_SAMPLE_DURATION = 0x000100;
+const uint32_t TRUN_SAMPLE_SIZE = 0x000200;
+const uint32_t TRUN_SAMPLE_FLAGS = 0x000400;
+
+const uint32_t VIDEO_TRACK_ID = 1;
+const uint32_t AUDIO_TRACK_ID = 2;
+
+// MPEG-1 audio (MP3) in the esds decoder config
+const uint8_t MP3_OBJECT_TYPE = 0x6b;
+const uint8_t AUDIO_STREAM_TYPE = 0x05;
+
+const size_t INITIAL_HEADER_CAPACITY = 16 * 1024;
+
+// Big-endian box serialization into a byte vector
+class BoxWriter {
+ public:
+  explicit BoxWriter(std::vector<uint8_t> & out)
+      : out_(out) {
+  }
+
+  size_t Begin(const char (&type)[5]) {
+    size_t offset = out_.size();
+    Put32(0);
+    Put32(foscam_hd::Mp4BoxType(type));
+    return offset;
+  }
+
+  size_t BeginFull(const char (&type)[5], uint8_t version, uint32_t flags) {
+    size_t offset = Begin(type);
+    Put32(static_cast<uint32_t>(version) << 24 | flags);
+    return offset;
+  }
+
+  void End(size_t offset) {
+    Patch32(offset, out_.size() - offset);
+  }
+
+  void Put8(uint8_t value) {
+    out_.push_back(value);
+  }
+
+  void Put16(uint16_t value) {
+    Put8(value >> 8);
+    Put8(value);
+  }
+
+  void Put32(uint32_t value) {
+    Put16(value >> 16);
+    Put16(value);
+  }
+
+  void Put64(uint64_t value) {
+    Put32(value >> 32);
+    Put32(value);
+  }
+
+  void PutZeros(size_t count) {
+    out_.insert(out_.end(), count, 0);
+  }
+
+  void PutBytes(const uint8_t * data, size_t size) {
+    out_.insert(out_.end(), data, data + size);
+  }
+
+  void PutMatrix() {
+    static const uint32_t UNITY_MATRIX[] = {
+      0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000
+    };
+    for (auto value : UNITY_MATRIX) {
+      Put32(value);
+    }
+  }
+
+  void Patch32(size_t offset, uint32_t value) {
+    out_[offset] = value >> 24;
+    out_[offset + 1] = value >> 16;
+    out_[offset + 2] = value >> 8;
+    out_[offset + 3] = value;
+  }
+
+  size_t size() const {
+    return out_.size();
+  }
+
+ private:
+  std::vector<uint8_t> & out_;
+};
+
+void WriteTrackHeader(BoxWriter & box, uint32_t track_id, uint16_t volume,
+                      uint32_t width, uint32_t height) {
+  size_t tkhd = box.BeginFull("tkhd", 0, 0x3);  // enabled, in movie
+  box.Put32(0);  // creation_time
+  box.Put32(0);  // modification_time
+  box.Put32(track_id);
+  box.Put32(0);
+  box.Put32(0);  // duration
+  box.PutZeros(8);
+  box.Put16(0);  // layer
+  box.Put16(0);  // alternate_group
+  box.Put16(volume);
+  box.Put16(0);
+  box.PutMatrix();
+  box.Put32(width << 16);
+  box.Put32(height << 16);
+  box.End(tkhd);
+}
+
+void WriteMediaHeader(BoxWriter & box, uint32_t timescale, uint32_t handler,
+                      const char * handler_name) {
+  size_t mdhd = box.BeginFull("mdhd", 0, 0);
+  box.Put32(0);  // creation_time
+  box.Put32(0);  // modification_time
+  box.Put32(timescale);
+  box.Put32(0);  // duration
+  box.Put16(0x55c4);  // language "und"
+  box.Put16(0);
+  box.End(mdhd);
+
+  size_t hdlr = box.BeginFull("hdlr", 0, 0);
+  box.Put32(0);
+  box.Put32(handler);
+  box.PutZeros(12);
+  box.PutBytes(reinterpret_cast<const uint8_t *>(handler_name),
+               strlen(handler_name) + 1);
+  box.End(hdlr);
+}
+
+void WriteDataInformation(BoxWriter & box) {
+  size_t dinf = box.Begin("dinf");
+  size_t dref = box.BeginFull("dref", 0, 0);
+  box.Put32(1);
+  box.End(box.BeginFull("url ", 0, 1));  // media in the same file
+  box.End(dref);
+  box.End(dinf);
+}
+
+// Empty sample tables, the samples are in the fragments
+void WriteEmptySampleTables(BoxWriter & box) {
+  size_t stts = box.BeginFull("stts", 0, 0);
+  box.Put32(0);
+  box.End(stts);
+  size_t stsc = box.BeginFull("stsc", 0, 0);
+  box.Put32(0);
+  box.End(stsc);
+  size_t stco = box.BeginFull("stco", 0, 0);
+  box.Put32(0);
+  box.End(stco);
+  size_t stsz = box.BeginFull("stsz", 0, 0);
+  box.Put32(0);  // sample_size
+  box.Put32(0);  // sample_count
+  box.End(stsz);
+}
+
+void WriteTrackExtends(BoxWriter & box, uint32_t track_id) {
+  size_t trex = box.BeginFull("trex", 0, 0);
+  box.Put32(track_id);
+  box.Put32(1);  // default_sample_description_index
+  box.Put32(0);  // default_sample_duration
+  box.Put32(0);  // default_sample_size
+  box.Put32(0);  // default_sample_flags
+  box.End(trex);
+}
+
+void WriteVideoTrack(BoxWriter & box, const SequenceParameterSet & parsed_sps,
+                     const std::vector<uint8_t> & sps,
+                     const std::vector<uint8_t> & pps) {
+  size_t trak = box.Begin("trak");
+  WriteTrackHeader(box, VIDEO_TRACK_ID, 0, parsed_sps.width, parsed_sps.height);
+
+  size_t mdia = box.Begin("mdia");
+  WriteMediaHeader(box, Fmp4Writer::VIDEO_TIMESCALE, Mp4BoxType("vide"),
+                   "VideoHandler");
+
+  size_t minf = box.Begin("minf");
+  size_t vmhd = box.BeginFull("vmhd", 0, 1);
+  box.PutZeros(8);  // graphicsmode, opcolor
+  box.End(vmhd);
+  WriteDataInformation(box);
+
+  size_t stbl = box.Begin("stbl");
+  size_t stsd = box.BeginFull("stsd", 0, 0);
+  box.Put32(1);
+  size_t avc1 = box.Begin("avc1");
+  box.PutZeros(6);
+  box.Put16(1);  // data_reference_index
+  box.PutZeros(16);
+  box.Put16(parsed_sps.width);
+  box.Put16(parsed_sps.height);
+  box.Put32(0x00480000);  // 72 dpi
+  box.Put32(0x00480000);
+  box.Put32(0);
+  box.Put16(1);  // frame_count
+  box.PutZeros(32);  // compressorname
+  box.Put16(0x0018);  // depth
+  box.Put16(0xffff);
+
+  size_t avcc = box.Begin("avcC");
+  box.Put8(1);  // configurationVersion
+  box.Put8(sps[1]);  // profile
+  box.Put8(sps[2]);  // profile compatibility
+  box.Put8(sps[3]);  // level
+  box.Put8(0xff);  // 4 byte NAL lengths
+  box.Put8(0xe1);  // one SPS
+  box.Put16(sps.size());
+  box.PutBytes(sps.data(), sps.size());
+  box.Put8(1);  // one PPS
+  box.Put16(pps.size());
+  box.PutBytes(pps.data(), pps.size());
+  box.End(avcc);
+  box.End(avc1);
+  box.End(stsd);
+
+  WriteEmptySampleTables(box);
+  box.End(stbl);
+  box.End(minf);
+  box.End(mdia);
+  box.End(trak);
+}
+
+void WriteAudioTrack(BoxWriter & box, const Fmp4Writer::AudioConfig & audio) {
+  size_t trak = box.Begin("trak");
+  WriteTrackHeader(box, AUDIO_TRACK_ID, 0x0100, 0, 0);
+
+  size_t mdia = box.Begin("mdia");
+  WriteMediaHeader(box, audio.sample_rate, Mp4BoxType("soun"),
+                   "SoundHandler");
+
+  size_t minf = box.Begin("minf");
+  size_t smhd = box.BeginFull("smhd", 0, 0);
+  box.Put16(0);  // balance
+  box.Put16(0);
+  box.End(smhd);
+  WriteDataInformation(box);
+
+  size_t stbl = box.Begin("stbl");
+  size_t stsd = box.BeginFull("stsd", 0, 0);
+  box.Put32(1);
+  size_t mp4a = box.Begin("mp4a");
+  box.PutZeros(6);
+  box.Put16(1);  // data_reference_index
+  box.PutZeros(8);
+  box.Put16(audio.channels);
+  box.Put16(16);  // samplesize
+  box.Put32(0);
+  box.Put32(audio.sample_rate << 16);
+
+  // ES descriptor with a decoder config and no decoder specific info
+  size_t esds = box.BeginFull("esds", 0, 0);
+  box.Put8(0x03);  // ES_DescrTag
+  box.Put8(3 + 2 + 13 + 2 + 1);
+  box.Put16(0);  // ES_ID
+  box.Put8(0);  // flags
+  box.Put8(0x04);  // DecoderConfigDescrTag
+  box.Put8(13);
+  box.Put8(MP3_OBJECT_TYPE);
+  box.Put8(AUDIO_STREAM_TYPE << 2 | 1);
+  box.Put8(0);  // bufferSizeDB
+  box.Put16(0);
+  box.Put32(audio.bit_rate);  // maxBitrate
+  box.Put32(audio.bit_rate);  // avgBitrate
+  box.Put8(0x06);  // SLConfigDescrTag
+  box.Put8(1);
+  box.Put8(0x02);  // predefined MP4 SL config
+  box.End(esds);
+  box.End(mp4a);
+  box.End(stsd);
+
+  WriteEmptySampleTables(box);
+  box.End(stbl);
+  box.End(minf);
+  box.End(mdia);
+  box.End(trak);
+}
+
+// Returns the offset of the trun data offset field, to be patched once the
+// moof size is known
+size_t WriteTrackFragment(BoxWriter & box, uint32_t track_id,
+                          const Fmp4Writer::Sample * samples, size_t count,
+                          const uint32_t * sample_sizes, uint64_t decode_time,
+                          uint64_t & data_size) {
+  size_t traf = box.Begin("traf");
+  size_t tfhd = box.BeginFull("tfhd", 0, TFHD_DEFAULT_BASE_IS_MOOF);
+  box.Put32(track_id);
+  box.End(tfhd);
+
+  size_t tfdt = box.BeginFull("tfdt", 1, 0);
+  box.Put64(decode_time);
+  box.End(tfdt);
+
+  size_t trun = box.BeginFull("trun", 0, TRUN_DATA_OFFSET |
+                              TRUN_SAMPLE_DURATION | TRUN_SAMPLE_SIZE |
+                              TRUN_SAMPLE_FLAGS);
+  box.Put32(count);
+  size_t data_offset = box.size();
+  box.Put32(0);
+  for (size_t idx = 0; idx < count; idx++) {
+    box.Put32(samples[idx].duration);
+    box.Put32(sample_sizes[idx]);
+    box.Put32(samples[idx].packet->keyframe ? KEYFRAME_SAMPLE_FLAGS :
+                                              DELTA_SAMPLE_FLAGS);
+    data_size += sample_sizes[idx];
+  }
+  box.End(trun);
+  box.End(traf);
+
+  return data_offset;
+}
+
+}  // namespace
+
+namespace foscam_hd {
+
+Fmp4WriterException::Fmp4WriterException(const std::string & what)
+    : what_("Fmp4WriterException: " + what) {
+}
+
+const char* Fmp4WriterException::what() const noexcept {
+  return what_.c_str();
+}
+
+Fmp4Writer::Fmp4Writer(const std::vector<uint8_t> & parameter_sets,
+                       const AudioConfig * audio)
+    : has_audio_(audio != nullptr), sequence_number_(0) {
+  if (audio) {
+    audio_ = *audio;
+  }
+
+  std::vector<uint8_t> sps;
+  std::vector<uint8_t> pps;
+  bool sps_parsed = false;
+  ForEachNalUnit(parameter_sets.data(), parameter_sets.size(),
+                 [&](const NalUnit & nal) {
+                   if (nal.type == NalUnitType::SPS && sps.empty()) {
+                     sps.assign(nal.data, nal.data + nal.size);
+                     sps_parsed = ParseSps(nal, sps_);
+                   } else if (nal.type == NalUnitType::PPS && pps.empty()) {
+                     pps.assign(nal.data, nal.data + nal.size);
+                   }
+                 });
+  if (!sps_parsed || sps.size() < 4 || pps.empty()) {
+    throw Fmp4WriterException("Missing or invalid parameter sets");
+  }
+
+  WriteInitSegment(sps, pps);
+  header_.reserve(INITIAL_HEADER_CAPACITY);
+}
+
+const std::vector<uint8_t> & Fmp4Writer::init_segment() const {
+  return init_segment_;
+}
+
+const SequenceParameterSet & Fmp4Writer::sps() const {
+  return sps_;
+}
+
+bool Fmp4Writer::has_audio() const {
+  return has_audio_;
+}
+
+void Fmp4Writer::WriteInitSegment(const std::vector<uint8_t> & sps,
+                                  const std::vector<uint8_t> & pps) {
+  BoxWriter box(init_segment_);
+
+  size_t ftyp = box.Begin("ftyp");
+  box.Put32(Mp4BoxType("isom"));
+  box.Put32(0x200);
+  for (auto brand : {Mp4BoxType("isom"), Mp4BoxType("iso6"),
+                     Mp4BoxType("avc1"), Mp4BoxType("mp41")}) {
+    box.Put32(brand);
+  }
+  box.End(ftyp);
+
+  size_t moov = box.Begin("moov");
+  size_t mvhd = box.BeginFull("mvhd", 0, 0);
+  box.Put32(0);  // creation_time
+  box.Put32(0);  // modification_time
+  box.Put32(1000);  // timescale
+  box.Put32(0);  // duration
+  box.Put32(0x00010000);  // rate
+  box.Put16(0x0100);  // volume
+  box.PutZeros(10);
+  box.PutMatrix();
+  box.PutZeros(24);
+  box.Put32(AUDIO_TRACK_ID + 1);  // next_track_ID
+  box.End(mvhd);
+
+  WriteVideoTrack(box, sps_, sps, pps);
+  if (has_audio_) {
+    WriteAudioTrack(box, audio_);
+  }
+
+  size_t mvex = box.Begin("mvex");
+  WriteTrackExtends(box, VIDEO_TRACK_ID);
+  if (has_audio_) {
+    WriteTrackExtends(box, AUDIO_TRACK_ID);
+  }
+  box.End(mvex);
+  box.End(moov);
+}
+
+size_t Fmp4Writer::PrepareFragment(const Sample * video, size_t video_count,
+                                   uint64_t video_decode_time,
+                                   const Sample * audio, size_t audio_count,
+                                   uint64_t audio_decode_time) {
+  // Collect the NAL units of each sample first so the length prefixes can be
+  // stored without reallocating under the pieces pointing at them. Parameter
+  // sets and delimiters are dropped, the init segment carries them.
+  nals_.clear();
+  sample_sizes_.clear();
+  for (size_t idx = 0; idx < video_count; idx++) {
+    const MediaPacket & packet = *video[idx].packet;
+    uint32_t sample_size = 0;
+    ForEachNalUnit(packet.data.data(), packet.data.size(),
+                   [this, &sample_size](const NalUnit & nal) {
+                     if (nal.type == NalUnitType::SPS ||
+                         nal.type == NalUnitType::PPS ||
+                         nal.type == NalUnitType::AUD) {
+                       return;
+                     }
+                     nals_.push_back(NalRef{nal.data, nal.size});
+                     sample_size += 4 + nal.size;
+                   });
+    sample_sizes_.push_back(sample_size);
+  }
+  for (size_t idx = 0; idx < audio_count; idx++) {
+    sample_sizes_.push_back(audio[idx].packet->data.size());
+  }
+  const uint32_t * video_sizes = sample_sizes_.data();
+  const uint32_t * audio_sizes = video_sizes + video_count;
+
+  header_.clear();
+  BoxWriter box(header_);
+  size_t moof = box.Begin("moof");
+  size_t mfhd = box.BeginFull("mfhd", 0, 0);
+  box.Put32(++sequence_number_);
+  box.End(mfhd);
+
+  uint64_t video_size = 0;
+  size_t video_data_offset = WriteTrackFragment(
+      box, VIDEO_TRACK_ID, video, video_count, video_sizes, video_decode_time,
+      video_size);
+  uint64_t audio_size = 0;
+  size_t audio_data_offset = 0;
+  if (has_audio_ && audio_count > 0) {
+    audio_data_offset = WriteTrackFragment(
+        box, AUDIO_TRACK_ID, audio, audio_count, audio_sizes,
+        audio_decode_time, audio_size);
+  }
+  box.End(moof);
+
+  // Sample data starts right after the mdat header, video then audio
+  box.Patch32(video_data_offset, box.size() + 8);
+  if (audio_data_offset) {
+    box.Patch32(audio_data_offset, box.size() + 8 + video_size);
+  }
+  box.Put32(8 + video_size + audio_size);
+  box.Put32(Mp4BoxType("mdat"));
+
+  nal_lengths_.resize(nals_.size() * 4);
+  pieces_.clear();
+  pieces_.push_back(iovec{header_.data(), header_.size()});
+  uint8_t * length = nal_lengths_.data();
+  for (auto & nal : nals_) {
+    length[0] = nal.size >> 24;
+    length[1] = nal.size >> 16;
+    length[2] = nal.size >> 8;
+    length[3] = nal.size;
+    pieces_.push_back(iovec{length, 4});
+    pieces_.push_back(iovec{const_cast<uint8_t *>(nal.data), nal.size});
+    length += 4;
+  }
+  if (audio_data_offset) {
+    for (size_t idx = 0; idx < audio_count; idx++) {
+      auto & data = audio[idx].packet->data;
+      pieces_.push_back(iovec{const_cast<uint8_t *>(data.data()),
+                              data.size()});
+    }
+  }
+
+  return header_.size() + video_size + audio_size;
+}
+
+const std::vector<struct iovec> & Fmp4Writer::pieces() const {
+  return pieces_;
+}
+
+}  // namespace foscam_hd
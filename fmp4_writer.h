@@ -0,0 +1,99 @@
+#ifndef FMP4_WRITER_H_
+#define FMP4_WRITER_H_
+
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "h264_parser.h"
+#include "media_packet.h"
+
+namespace foscam_hd {
+
+constexpr uint32_t Mp4BoxType(const char (&type)[5]) {
+  return static_cast<uint32_t>(static_cast<uint8_t>(type[0])) << 24 |
+         static_cast<uint32_t>(static_cast<uint8_t>(type[1])) << 16 |
+         static_cast<uint32_t>(static_cast<uint8_t>(type[2])) << 8 |
+         static_cast<uint32_t>(static_cast<uint8_t>(type[3]));
+}
+
+class Fmp4WriterException : public std::exception {
+ public:
+  explicit Fmp4WriterException(const std::string & what);
+
+  const char* what() const noexcept override;
+
+ private:
+  std::string what_;
+};
+
+// Fragmented mp4 writer for an H.264 track and an optional MP3 track. The
+// init segment is built from the SPS/PPS; each fragment is laid out as
+// moof+mdat headers in reused memory followed by references to the NAL units
+// of the access units, with their start codes replaced by lengths, and to
+// the audio frames.
+class Fmp4Writer {
+ public:
+  static const uint32_t VIDEO_TIMESCALE = 90000;
+
+  // Audio samples are timed in units of the sample rate
+  struct AudioConfig {
+    uint32_t sample_rate;
+    uint16_t channels;
+    uint32_t bit_rate;
+  };
+
+  struct Sample {
+    MediaPacketPtr packet;
+    uint32_t duration;
+  };
+
+  // parameter_sets holds the Annex-B SPS and PPS of the stream
+  Fmp4Writer(const std::vector<uint8_t> & parameter_sets,
+             const AudioConfig * audio = nullptr);
+
+  const std::vector<uint8_t> & init_segment() const;
+  const SequenceParameterSet & sps() const;
+  bool has_audio() const;
+
+  // Lays out a fragment of the samples of each track, the first ones decoded
+  // at the given decode times. Returns the fragment size; its content is
+  // given by pieces() until the next call. The samples must outlive the
+  // pieces.
+  size_t PrepareFragment(const Sample * video, size_t video_count,
+                         uint64_t video_decode_time,
+                         const Sample * audio = nullptr, size_t audio_count = 0,
+                         uint64_t audio_decode_time = 0);
+  const std::vector<struct iovec> & pieces() const;
+
+ private:
+  struct NalRef {
+    const uint8_t * data;
+    size_t size;
+  };
+
+  void WriteInitSegment(const std::vector<uint8_t> & sps,
+                        const std::vector<uint8_t> & pps);
+
+  SequenceParameterSet sps_;
+  bool has_audio_;
+  AudioConfig audio_;
+  std::vector<uint8_t> init_segment_;
+  uint32_t sequence_number_;
+
+  // Reused from fragment to fragment
+  std::vector<uint8_t> header_;
+  std::vector<NalRef> nals_;
+  std::vector<uint32_t> sample_sizes_;
+  std::vector<uint8_t> nal_lengths_;
+  std::vector<struct iovec> pieces_;
+
+  Fmp4Writer(const Fmp4Writer &) = delete;
+  Fmp4Writer & operator=(const Fmp4Writer &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // FMP4_WRITER_H_
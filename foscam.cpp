@@ -1,360 +1,58 @@
 #include "foscam.h"
 
-#include <endian.h>
-
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 #include <utility>
 #include <vector>
-#include <boost/fusion/include/define_struct.hpp>
-#include <boost/fusion/include/for_each.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/xml_parser.hpp>
 
+#include "foscam_protocol.h"
+#include "h264_parser.h"
+#include "handler_allocator.h"
+
 namespace baio = boost::asio;
 namespace bpt = boost::property_tree;
 
-namespace foscam_api {
-
-enum class Command : uint32_t {
-    VIDEO_ON_REQUEST = 0x00,
-    CLOSE_CONNECTION = 0x01,
-    AUDIO_ON_REQUEST = 0x02,
-    VIDEO_ON_REPLY = 0x10,
-    AUDIO_ON_REPLY = 0x12,
-    VIDEO_DATA = 0x1a,
-    AUDIO_DATA = 0x1b,
-
-#if 0
-// User to cam
-AUDIO_OFF = 0x03,
-SPEAKER_ON = 0x04,
-SPEAKER_OFF = 0x05,
-
-TALK_AUDIO_DATA = 0x06,
-LOGIN_REQ = 0x0c,
-LOGIN_CHECK = 0x0f,
-
-// Cam to user
-SPEAKER_ON_REPLY = 0x14,
-SPEAKER_OFF_REPLY = 0x15,
-
-LOGIN_CHECK_REPLY = 0x1d,
-PTZ_INFO = 0x64,
-PRESET_POINT_UNCHANGED = 0x6A,
-CRUISES_LIST_CHANGED = 0x6B,
-SHOW_MIRROR_FLIP = 0x6C,
-SHOW_COLOR_ADJUST_VALUES = 0x6E,
-MOTION_DETECTION_ALERT = 0x6F,
-SHOWE_POWER_FREQ = 0x70,
-STREAM_SELECT_REPLY = 0x71
-#endif
-};
-
-using Magic = std::integral_constant<uint32_t, 0x43534f46>;  // FOSC
-
-enum class Videostream : uint8_t {
-  MAIN = 0,
-  SUB = 1
-};
-
-template<size_t N>
-struct FixedString {
-  static const size_t size = N;
-
-  char str[N];
-};
-
-template<size_t N>
-struct Reserved {
-  static const size_t size = N;
-};
-
-}  // namespace foscam_api
-
-BOOST_FUSION_DEFINE_STRUCT(
-  (foscam_api), Header,
-  (foscam_api::Command, type)
-  (foscam_api::Magic, magic)
-  (uint32_t, size)
-)
-
-BOOST_FUSION_DEFINE_STRUCT(
-  (foscam_api),
-  CloseConnection,
-  (foscam_api::Reserved<1>, reserved)
-  (foscam_api::FixedString<64>, username)
-  (foscam_api::FixedString<64>, password)
-)
-
-BOOST_FUSION_DEFINE_STRUCT(
-  (foscam_api),
-  VideoOnRequest,
-  (foscam_api::Videostream, stream)
-  (foscam_api::FixedString<64>, username)
-  (foscam_api::FixedString<64>, password)
-  (uint32_t, uid)
-  (foscam_api::Reserved<28>, reserved)
-)
-
-BOOST_FUSION_DEFINE_STRUCT(
-  (foscam_api), VideoOnReply,
-  (uint8_t, failed)
-  (foscam_api::Reserved<35>, reserved)
-)
-
-BOOST_FUSION_DEFINE_STRUCT(
-  (foscam_api),
-  AudioOnRequest,
-  (foscam_api::Reserved<1>, reserved0)
-  (foscam_api::FixedString<64>, username)
-  (foscam_api::FixedString<64>, password)
-  (foscam_api::Reserved<32>, reserved1)
-)
-
-BOOST_FUSION_DEFINE_STRUCT(
-  (foscam_api), AudioOnReply,
-  (uint8_t, failed)
-  (foscam_api::Reserved<35>, reserved)
-)
-
-BOOST_FUSION_DEFINE_STRUCT(
-  (foscam_api), AudioDataHeader,
-  (foscam_api::Reserved<36>, reserved)
-)
-
-namespace endian {
-
-template<class T> T ntoh(T) = delete;
-uint32_t ntoh(uint32_t v) { return le32toh(v); }
-uint16_t ntoh(uint16_t v) { return le16toh(v); }
-uint8_t ntoh(uint8_t v) { return v; }
-int8_t ntoh(int8_t v) { return v; }
-char ntoh(char v) { return v; }
-
-template<class T> T hton(T) = delete;
-uint32_t hton(uint32_t v) { return htole32(v); }
-uint16_t hton(uint16_t v) { return htole16(v); }
-uint8_t hton(uint8_t v) { return v; }
-int8_t hton(int8_t v) { return v; }
-char hton(char v) { return v; }
-
-}  // namespace endian
-
 namespace {
 
-struct Reader {
-  mutable baio::const_buffer buf_;
-
-  explicit Reader(baio::const_buffer buf)
-      : buf_(std::move(buf)) {
-  }
-
-  template<class T>
-  auto operator()(T & val) const ->
-  typename std::enable_if<std::is_integral<T>::value>::type {
-    val = endian::ntoh(*baio::buffer_cast<T const*>(buf_));
-    buf_ = buf_ + sizeof(T);
-  }
-
-  template<class T>
-  auto operator()(T & val) const ->
-  typename std::enable_if<std::is_enum<T>::value>::type {
-    typename std::underlying_type<T>::type v;
-    (*this)(v);
-    val = static_cast<T>(v);
-  }
-
-  template<class T, T v>
-  void operator()(std::integral_constant<T, v>) const {
-    typedef std::integral_constant<T, v> type;
-    typename type::value_type val;
-    (*this)(val);
-    if (val != type::value)
-      throw foscam_hd::FoscamException("Invalid integral constant.");
-  }
-
-  template<size_t N>
-  void operator()(foscam_api::Reserved<N>) const {
-    buf_ = buf_ + N;
-  }
-
-  template<size_t N>
-  void operator()(foscam_api::FixedString<N>& val) const {
-    for (size_t idx = 0; idx < N; idx++) {
-      char v;
-      (*this)(v);
-      val.str[idx] = v;
-    }
-  }
-
-  template<class T>
-  auto operator()(T & val) const ->
-  typename std::enable_if<boost::fusion::traits::is_sequence<T>::value>::type {
-    boost::fusion::for_each(val, *this);
-  }
-};
-
-struct Writer {
-  mutable baio::mutable_buffer buf_;
-
-  explicit Writer(baio::mutable_buffer buf)
-      : buf_(std::move(buf)) {
-  }
-
-  template<class T>
-  auto operator()(T const& val) const ->
-  typename std::enable_if<std::is_integral<T>::value>::type {
-    T tmp = endian::hton(val);
-    baio::buffer_copy(buf_, baio::buffer(&tmp, sizeof(T)));
-    buf_ = buf_ + sizeof(T);
-  }
-
-  template<class T>
-  auto operator()(T const& val) const ->
-  typename std::enable_if<std::is_enum<T>::value>::type {
-    using utype = typename std::underlying_type<T>::type;
-    (*this)(static_cast<utype>(val));
-  }
-
-  template<class T, T v>
-  void operator()(std::integral_constant<T, v>) const {
-    typedef std::integral_constant<T, v> type;
-    (*this)(type::value);
-  }
-
-  template<size_t N>
-  void operator()(foscam_api::Reserved<N>) const {
-    for (size_t idx = 0; idx < N; idx++) {
-      (*this)(static_cast<uint8_t>(0));
-    }
-  }
-
-  template<size_t N>
-  void operator()(foscam_api::FixedString<N> const& val) const {
-    for (size_t idx = 0; idx < N; idx++) {
-      (*this)(val.str[idx]);
-    }
-  }
-
-  template<class T>
-  auto operator()(T const& val) const ->
-  typename std::enable_if<boost::fusion::traits::is_sequence<T>::value>::type {
-    boost::fusion::for_each(val, *this);
-  }
-};
-
-struct Sizer {
-  mutable size_t size_ = 0;
-
-  template<class T>
-  auto operator()(T const&) const ->
-  typename std::enable_if<std::is_integral<T>::value>::type {
-    size_ += sizeof(T);
-  }
-
-  template<class T>
-  auto operator()(T const&) const ->
-  typename std::enable_if<std::is_enum<T>::value>::type {
-    typename std::underlying_type<T>::type v;
-    (*this)(v);
-  }
-
-  template<class T, T v>
-  void operator()(std::integral_constant<T, v>) const {
-    typedef std::integral_constant<T, v> type;
-    typename type::value_type val;
-    (*this)(val);
-  }
-
-  template<size_t N>
-  void operator()(foscam_api::Reserved<N>) const {
-    size_ += N;
-  }
-
-  template<size_t N>
-  void operator()(foscam_api::FixedString<N>) const {
-    size_ += N;
-  }
-
-  template<class T>
-  auto operator()(T const& val) const ->
-  typename std::enable_if<boost::fusion::traits::is_sequence<T>::value>::type {
-    boost::fusion::for_each(val, *this);
-  }
-};
-
-template<typename T>
-T read(baio::const_buffer b) {
-  Reader r(std::move(b));
-  T res;
-  r(res);
-  return res;
-}
-
-template<typename T>
-baio::mutable_buffer write(baio::mutable_buffer b, T const& val) {
-  Writer w(std::move(b));
-  w(val);
-  return w.buf_;
-}
+// About 8 seconds of packets at 30 fps
+const size_t VIDEO_RING_CAPACITY = 256;
+const size_t AUDIO_RING_CAPACITY = 256;
 
-template<class T>
-size_t get_size() {
-  Sizer s;
-  T v;
-  s(v);
-  return s.size_;
-}
+// Messages larger than half of it are read straight into their packet
+const size_t RECEIVE_BUFFER_SIZE = 256 * 1024;
 
-class ReadPacketFunc : public ffmpeg_wrapper::InDataFunctor {
- public:
-  explicit ReadPacketFunc(foscam_hd::PipeBuffer & data_buffer)
-      : data_buffer_(data_buffer) {
-  }
+// Main stream keyframes stay well under this, a larger size field is corrupt
+// and would only make us allocate whatever it claims
+const size_t MAX_MESSAGE_SIZE = 4 * 1024 * 1024;
 
-  int operator()(uint8_t * buffer, int buffer_size) override {
-    return data_buffer_.wait_and_pop(buffer, buffer_size,
-                                     std::chrono::milliseconds(10));
-  }
+// Per-viewer budget before data is dropped up to the next keyframe
+const size_t DEFAULT_STREAM_MAX_BYTES = 16 * 1024 * 1024;
+const std::chrono::milliseconds DEFAULT_STREAM_MAX_DELAY(10000);
 
-  size_t GetAvailableData() const override {
-    return data_buffer_.read_available();
-  }
+// Waits end as soon as data is pushed, this only bounds how long a viewer
+// connection thread blocks when the camera stalls
+const std::chrono::milliseconds STREAM_WAIT_TIMEOUT(1000);
 
- private:
-  foscam_hd::PipeBuffer & data_buffer_;
-};
+// Low latency viewers further behind skip ahead to a keyframe
+const std::chrono::milliseconds LOW_LATENCY_MAX_DELAY(300);
 
-class VideoStreamFunc : public ffmpeg_wrapper::OutStreamFunctor {
- public:
-  explicit VideoStreamFunc(foscam_hd::PipeBuffer & data_buffer)
-      : data_buffer_(data_buffer) {
-  }
+// The stream settings and the video and audio on replies
+const int START_STEPS = 3;
 
-  void operator()(const uint8_t * buffer, int buffer_size) override {
-    data_buffer_.push(buffer, buffer_size);
-  }
-
- private:
-  foscam_hd::PipeBuffer & data_buffer_;
-};
+constexpr size_t HEADER_SIZE = foscam_api::wire_size<foscam_api::Header>();
+constexpr size_t AUDIO_DATA_HEADER_SIZE =
+    foscam_api::wire_size<foscam_api::AudioDataHeader>();
 
 template<typename T>
 std::vector<uint8_t> PrepareLowLevelCommand(foscam_api::Command type,
     std::function<void(T &)> yield_command_func) {
-  foscam_api::Header header;
-  header.type = type;
-  header.size = get_size<T>();
-  T request;
+  T request{};
   yield_command_func(request);
-
-  auto header_size = get_size<foscam_api::Header>();
-  std::vector<uint8_t> message_buf(header_size + header.size);
-  write(baio::buffer(message_buf), header);
-  write(baio::buffer(message_buf) + header_size, request);
-
-  return message_buf;
+  return foscam_api::EncodeCommand(type, request);
 }
 
 void PrepareHTTPRequest(const std::string & method, const std::string & path,
@@ -368,75 +66,51 @@ void PrepareHTTPRequest(const std::string & method, const std::string & path,
   command_stream << "Connection: close\r\n\r\n";
 }
 
-bpt::ptree ReadCgiResponse(baio::ip::tcp::socket & socket)
-{
-  // Read status line
-  baio::streambuf response;
-  {
-    baio::read_until(socket, response, "\r\n");
-    std::istream response_stream(&response);
+bpt::ptree ParseCgiResponse(baio::streambuf & response) {
+  std::istream response_stream(&response);
 
-    std::string http_version;
-    response_stream >> http_version;
+  // Read status line
+  std::string http_version;
+  response_stream >> http_version;
 
-    unsigned int status_code;
-    response_stream >> status_code;
+  unsigned int status_code;
+  response_stream >> status_code;
 
-    std::string status_message;
-    std::getline(response_stream, status_message);
-    if (!response_stream || http_version.substr(0, 5) != "HTTP/")
-    {
-      throw foscam_hd::FoscamException("Invalid response");
-    }
-    if (status_code != 200)
-    {
-      throw foscam_hd::FoscamException("Response returned with status code " +
-                                       std::to_string(status_code));
-    }
+  std::string status_message;
+  std::getline(response_stream, status_message);
+  if (!response_stream || http_version.substr(0, 5) != "HTTP/")
+  {
+    throw foscam_hd::FoscamException("Invalid response");
   }
-
-  // Skip headers
-
-  std::stringstream data;
+  if (status_code != 200)
   {
-    baio::read_until(socket, response, "\r\n\r\n");
-    std::istream response_stream(&response);
-    std::string header;
-    while (std::getline(response_stream, header) && header != "\r");
-
-    // Write whatever content we already have to output.
-    if (response.size() > 0)
-      data << &response;
+    throw foscam_hd::FoscamException("Response returned with status code " +
+                                     std::to_string(status_code));
   }
 
-  // Read rest of data
-  boost::system::error_code ec;
-  do {
-    baio::read(socket, response, baio::transfer_at_least(1), ec);
-    if (response.size() > 0)
-      data << &response;
-  } while(!ec);
+  // Skip headers
+  std::string header;
+  while (std::getline(response_stream, header) && header != "\r");
 
   // Parse data
   bpt::ptree response_tree;
-  bpt::read_xml(data, response_tree);
+  bpt::read_xml(response_stream, response_tree);
+
+  // Bad credentials and the like still come with status code 200
+  int result = response_tree.get<int>("CGI_Result.result", 0);
+  if (result != 0)
+  {
+    throw foscam_hd::FoscamException("CGI command returned with result " +
+                                     std::to_string(result));
+  }
 
   return response_tree;
 }
 
-bpt::ptree ExecuteCgiCommand(
-    const std::string & method, const std::string & path,
-    const std::string & host, const std::string & port,
-    baio::io_service & io_service) {
-  baio::ip::tcp::resolver resolver(io_service);
-  baio::ip::tcp::socket socket(io_service);
-  baio::connect(socket, resolver.resolve({host, port}));
-
-  baio::streambuf request;
-  PrepareHTTPRequest(method, path, host, port, request);
-
-  baio::write(socket, request);
-  return ReadCgiResponse(socket);
+std::exception_ptr StartError(const std::string & what,
+                              boost::system::error_code ec) {
+  return std::make_exception_ptr(
+      foscam_hd::FoscamException(what + ": " + ec.message()));
 }
 
 }  // namespace
@@ -451,68 +125,239 @@ const char* FoscamException::what() const noexcept {
   return what_.c_str();
 }
 
-Foscam::Stream::Stream(Foscam & parent, const int framerate, bool audio_on)
-    : parent_(parent),
-      remuxer_(
-          std::make_unique<ReadPacketFunc>(video_buffer_),
-          {"-f", "h264", "-r", "30", "-probesize", "1024"},
-          audio_on ? std::make_unique<ReadPacketFunc>(audio_buffer_) : nullptr,
-          {"-f", "u16le", "-ar", "8000", "-ac", "1"},
-          std::make_unique<VideoStreamFunc>(video_stream_buffer_),
-          {"-vcodec", "copy", "-f", "mp4", "-reset_timestamps", "1",
-           "-movflags", "empty_moov+default_base_moof+frag_keyframe"})
-{
-  parent_.active_streams_.insert(this);
+Foscam::Stream::Stream(std::shared_ptr<RemuxSession> session,
+                       const BufferLimits & limits,
+                       BroadcastRing::Start start)
+    : session_(session),
+      init_segment_offset_(0),
+      fragment_reader_(session_->fragments(), start),
+      fragment_offset_(0),
+      fragments_(0),
+      total_latency_(0),
+      max_latency_(0) {
+  fragment_reader_.set_limits(limits);
+  fragment_reader_.set_notifier(&fragment_ready_);
 }
 
-Foscam::Stream::~Stream()
-{
-  parent_.active_streams_.erase(this);
+Foscam::Stream::~Stream() {
+  fragment_reader_.set_notifier(nullptr);
 }
 
 unsigned int Foscam::Stream::GetVideoStreamData(uint8_t * data,
                                                 size_t data_size) {
-  return video_stream_buffer_.wait_and_pop(data, data_size,
-                                           std::chrono::milliseconds(10));
+  // New viewers get the cached init segment, then join at the next fragment
+  if (!init_segment_) {
+    init_segment_ = session_->WaitInitSegment(STREAM_WAIT_TIMEOUT);
+    if (!init_segment_) {
+      return 0;
+    }
+  }
+  if (init_segment_offset_ < init_segment_->size()) {
+    size_t size = std::min(init_segment_->size() - init_segment_offset_,
+                           data_size);
+    memcpy(data, init_segment_->data() + init_segment_offset_, size);
+    init_segment_offset_ += size;
+    return size;
+  }
+
+  if (!fragment_) {
+    fragment_ = WaitFragment();
+    if (!fragment_) {
+      return 0;
+    }
+    fragment_offset_ = 0;
+
+    auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - fragment_->timestamp);
+    fragments_++;
+    total_latency_ += latency;
+    max_latency_ = std::max(max_latency_, latency);
+  }
+
+  size_t size = std::min(fragment_->data.size() - fragment_offset_,
+                         data_size);
+  memcpy(data, fragment_->data.data() + fragment_offset_, size);
+  fragment_offset_ += size;
+  if (fragment_offset_ == fragment_->data.size()) {
+    fragment_.reset();
+  }
+  return size;
+}
+
+MediaPacketPtr Foscam::Stream::WaitFragment() {
+  uint64_t generation = fragment_ready_.generation();
+  MediaPacketPtr fragment = fragment_reader_.try_read_packet();
+  if (!fragment) {
+    fragment_ready_.Wait(generation, STREAM_WAIT_TIMEOUT);
+    fragment = fragment_reader_.try_read_packet();
+  }
+  return fragment;
+}
+
+auto Foscam::Stream::GetStats() const -> Stats {
+  Stats stats;
+  stats.video_input = session_->video_input_drop_stats();
+  stats.audio_input = session_->audio_input_drop_stats();
+  stats.output = fragment_reader_.drop_stats();
+  stats.fragments = fragments_;
+  if (fragments_) {
+    stats.mean_latency = total_latency_ / fragments_;
+  }
+  stats.max_latency = max_latency_;
+  stats.interleave = session_->interleave_stats();
+  return stats;
+}
+
+// A CGI command on a connection of its own, with its handlers on the
+// camera's strand
+class CgiRequest : public std::enable_shared_from_this<CgiRequest> {
+ public:
+  using ResponseHandler = std::function<void(const bpt::ptree & response)>;
+  using ErrorHandler = std::function<void(std::exception_ptr error)>;
+
+  CgiRequest(baio::io_service::strand & strand, const std::string & host,
+             const std::string & port, const std::string & path);
+
+  // Failures, including those of the response handler, go to the error
+  // handler
+  void Start(const baio::ip::tcp::resolver::results_type & endpoints,
+             ResponseHandler on_response, ErrorHandler on_error);
+  void Cancel();
+
+ private:
+  void Finish(boost::system::error_code ec);
+
+  baio::io_service::strand & strand_;
+  baio::ip::tcp::socket socket_;
+  baio::streambuf request_;
+  baio::streambuf response_;
+  ResponseHandler on_response_;
+  ErrorHandler on_error_;
+
+  CgiRequest(const CgiRequest &) = delete;
+  CgiRequest & operator=(const CgiRequest &) = delete;
+};
+
+CgiRequest::CgiRequest(baio::io_service::strand & strand,
+                       const std::string & host, const std::string & port,
+                       const std::string & path)
+    : strand_(strand), socket_(strand.context()) {
+  PrepareHTTPRequest("GET", path, host, port, request_);
+}
+
+void CgiRequest::Start(
+    const baio::ip::tcp::resolver::results_type & endpoints,
+    ResponseHandler on_response, ErrorHandler on_error) {
+  auto self(shared_from_this());
+  on_response_ = on_response;
+  on_error_ = on_error;
+
+  baio::async_connect(socket_, endpoints, baio::bind_executor(strand_,
+      [this, self](boost::system::error_code ec,
+                   const baio::ip::tcp::endpoint &) {
+        if (ec) {
+          Finish(ec);
+          return;
+        }
+        baio::async_write(socket_, request_, baio::bind_executor(strand_,
+            [this, self](boost::system::error_code ec, std::size_t) {
+              if (ec) {
+                Finish(ec);
+                return;
+              }
+              // The camera closes the connection after the response
+              baio::async_read(socket_, response_, baio::bind_executor(
+                  strand_,
+                  [this, self](boost::system::error_code ec, std::size_t) {
+                    Finish(ec == baio::error::eof ?
+                           boost::system::error_code() : ec);
+                  }));
+            }));
+      }));
+}
+
+void CgiRequest::Cancel() {
+  boost::system::error_code ec;
+  socket_.close(ec);
+}
+
+void CgiRequest::Finish(boost::system::error_code ec) {
+  Cancel();
+  try {
+    if (ec) {
+      throw FoscamException("CGI request failed: " + ec.message());
+    }
+    on_response_(ParseCgiResponse(response_));
+  } catch (...) {
+    on_error_(std::current_exception());
+  }
 }
 
 Foscam::Foscam(const std::string & host, unsigned int port, unsigned int uid,
                const std::string & user, const std::string & password,
-               baio::io_service & io_service)
-    : io_service_(io_service), low_level_api_socket_(io_service),
+               baio::io_service & io_service, WorkerPool & worker_pool)
+    : io_service_(io_service), worker_pool_(worker_pool),
+      strand_(io_service), low_level_api_socket_(io_service),
       host_(host), port_(std::to_string(port)), uid_(uid), user_(user),
-      password_(password), framerate_(0), audio_on_(false) {
-
-  baio::ip::tcp::resolver resolver(io_service_);
-  baio::connect(low_level_api_socket_, resolver.resolve({host_, port_}));
-
-  baio::streambuf conn_command;
-  PrepareHTTPRequest("SERVERPUSH", "/", host_, port_, conn_command);
-  baio::write(low_level_api_socket_, conn_command);
-
-  // Get stream type
-  auto response = ExecuteCgiCommand(
-      "GET",
-      "/cgi-bin/CGIProxy.fcgi?cmd=getMainVideoStreamType&usr=" +
-        user_ + "&pwd=" + password_,
-      host_, port_, io_service_);
-  auto stream_type = response.get<unsigned int>("CGI_Result.streamType");
-
-  // Get framerate for stream type
-  response = ExecuteCgiCommand(
-      "GET",
-      "/cgi-bin/CGIProxy.fcgi?cmd=getVideoStreamParam&usr=" +
-        user_ + "&pwd=" + password_,
-      host_, port_, io_service_);
-  framerate_ = response.get<unsigned int>("CGI_Result.frameRate" +
-                                          std::to_string(stream_type));
+      password_(password), framerate_(0), audio_on_(false),
+      audio_resampler_(AudioTranscoder::Resampler::NATIVE),
+      receive_buffer_(RECEIVE_BUFFER_SIZE), receive_begin_(0),
+      receive_end_(0), connected_(false), disconnecting_(false),
+      packet_pool_(std::make_shared<PacketPool>()),
+      resolver_(io_service), start_timer_(io_service),
+      start_steps_left_(0),
+      video_ring_(VIDEO_RING_CAPACITY), audio_ring_(AUDIO_RING_CAPACITY) {
+  stream_limits_.max_bytes = DEFAULT_STREAM_MAX_BYTES;
+  stream_limits_.max_delay = DEFAULT_STREAM_MAX_DELAY;
 }
 
 Foscam::~Foscam() {
 }
 
-void Foscam::Connect() {
-  ReadHeader();
+void Foscam::Start(std::chrono::milliseconds timeout, StartHandler handler) {
+  auto self(shared_from_this());
+  strand_.post([this, self, timeout, handler]() {
+    start_handler_ = handler;
+    start_steps_left_ = START_STEPS;
+
+    start_timer_.expires_after(timeout);
+    start_timer_.async_wait(baio::bind_executor(strand_,
+        [this, self](boost::system::error_code ec) {
+          if (!ec) {
+            FinishStart(std::make_exception_ptr(
+                FoscamException("Timed out starting " + host_ + ".")));
+          }
+        }));
+
+    resolver_.async_resolve(host_, port_, baio::bind_executor(strand_,
+        [this, self](boost::system::error_code ec,
+                     baio::ip::tcp::resolver::results_type endpoints) {
+          if (!start_handler_) {
+            return;
+          }
+          if (ec) {
+            FinishStart(StartError("Failed to resolve " + host_, ec));
+            return;
+          }
+
+          // The CGI commands run next to the low level API connection
+          QueryFramerate(endpoints);
+          baio::async_connect(
+              low_level_api_socket_, endpoints, baio::bind_executor(strand_,
+                  [this, self](boost::system::error_code ec,
+                               const baio::ip::tcp::endpoint &) {
+                    if (!start_handler_) {
+                      return;
+                    }
+                    if (ec) {
+                      FinishStart(StartError("Failed to connect to " + host_,
+                                             ec));
+                      return;
+                    }
+                    OpenLowLevelApi();
+                  }));
+        }));
+  });
 }
 
 void Foscam::Disconnect() {
@@ -525,13 +370,19 @@ void Foscam::Disconnect() {
                 request.password.size);
       });
 
-  baio::write(low_level_api_socket_, baio::buffer(message_buf));
+  Send(std::move(message_buf), true);
 }
 
-bool Foscam::VideoOn() {
-  std::unique_lock<std::mutex> lock(reply_cond_mutex_);
+void Foscam::OpenLowLevelApi() {
+  connected_ = true;
+  baio::streambuf conn_command;
+  PrepareHTTPRequest("SERVERPUSH", "/", host_, port_, conn_command);
+  auto conn_data = conn_command.data();
+  Send(std::vector<uint8_t>(baio::buffers_begin(conn_data),
+                            baio::buffers_end(conn_data)));
 
-  auto message_buf = PrepareLowLevelCommand<foscam_api::VideoOnRequest>(
+  // Both requests go out at once, the replies are counted as they come
+  Send(PrepareLowLevelCommand<foscam_api::VideoOnRequest>(
       foscam_api::Command::VIDEO_ON_REQUEST,
       [this](foscam_api::VideoOnRequest & request){
         strncpy(request.username.str, user_.c_str(),
@@ -539,181 +390,372 @@ bool Foscam::VideoOn() {
         strncpy(request.password.str, password_.c_str(),
                 request.password.size);
         request.uid = uid_;
-      });
-
-  baio::write(low_level_api_socket_, baio::buffer(message_buf));
+      }));
 
-  video_on_reply_cond_.wait(lock);
-
-  return true;
-}
-
-bool Foscam::AudioOn() {
-  std::unique_lock<std::mutex> lock(reply_cond_mutex_);
-
-  auto message_buf = PrepareLowLevelCommand<foscam_api::AudioOnRequest>(
+  Send(PrepareLowLevelCommand<foscam_api::AudioOnRequest>(
       foscam_api::Command::AUDIO_ON_REQUEST,
       [this](foscam_api::AudioOnRequest & request){
         strncpy(request.username.str, user_.c_str(),
                 request.username.size);
         strncpy(request.password.str, password_.c_str(),
                 request.password.size);
-      });
+      }));
 
-  baio::write(low_level_api_socket_, baio::buffer(message_buf));
+  Receive();
+}
 
-  audio_on_reply_cond_.wait(lock);
+void Foscam::QueryFramerate(
+    const baio::ip::tcp::resolver::results_type & endpoints) {
+  auto self(shared_from_this());
+  auto on_error = [this, self](std::exception_ptr error) {
+    FinishStart(error);
+  };
+
+  // Both commands are sent at once, the framerate of the main stream is
+  // picked once both have answered
+  auto stream_type = std::make_shared<unsigned int>();
+  auto stream_params = std::make_shared<bpt::ptree>();
+  auto pending = std::make_shared<int>(2);
+  auto on_answered = [this, stream_type, stream_params, pending]() {
+    if (--*pending == 0) {
+      framerate_ = stream_params->get<unsigned int>(
+          "CGI_Result.frameRate" + std::to_string(*stream_type));
+      StartStepDone();
+    }
+  };
+
+  auto cgi_path = [this](const std::string & command) {
+    return "/cgi-bin/CGIProxy.fcgi?cmd=" + command + "&usr=" + user_ +
+        "&pwd=" + password_;
+  };
+
+  auto request = std::make_shared<CgiRequest>(
+      strand_, host_, port_, cgi_path("getMainVideoStreamType"));
+  request->Start(endpoints, [stream_type, on_answered](
+      const bpt::ptree & response) {
+    *stream_type = response.get<unsigned int>("CGI_Result.streamType");
+    on_answered();
+  }, on_error);
+  cgi_requests_.push_back(request);
+
+  request = std::make_shared<CgiRequest>(
+      strand_, host_, port_, cgi_path("getVideoStreamParam"));
+  request->Start(endpoints, [stream_params, on_answered](
+      const bpt::ptree & response) {
+    *stream_params = response;
+    on_answered();
+  }, on_error);
+  cgi_requests_.push_back(request);
+}
 
-  return audio_on_;
+void Foscam::StartStepDone() {
+  if (start_handler_ && --start_steps_left_ == 0) {
+    FinishStart(nullptr);
+  }
 }
 
-auto Foscam::CreateStream() -> std::unique_ptr<Stream>
-{
-  return std::make_unique<Stream>(*this, framerate_, audio_on_);
+void Foscam::FinishStart(std::exception_ptr error) {
+  // Only the first outcome counts, the timeout may race with the last step
+  if (!start_handler_) {
+    return;
+  }
+  StartHandler handler;
+  handler.swap(start_handler_);
+
+  start_timer_.cancel();
+  resolver_.cancel();
+  for (auto & request : cgi_requests_) {
+    request->Cancel();
+  }
+  cgi_requests_.clear();
+  if (error) {
+    CloseConnection();
+  }
+
+  handler(error);
 }
 
-void Foscam::ReadHeader() {
-  auto self(shared_from_this());
-  auto header_size = get_size<foscam_api::Header>();
-  auto header_buf = std::make_shared<std::vector<uint8_t> >(header_size);
+void Foscam::FailConnection(const std::string & error) {
+  std::cerr << "Closing the connection to " << host_ << ": " << error
+            << std::endl;
+  FinishStart(std::make_exception_ptr(FoscamException(error)));
+  CloseConnection();
+}
 
-  baio::async_read(
-      low_level_api_socket_,
-      baio::buffer(*header_buf),
-      [this, self, header_buf](boost::system::error_code ec, std::size_t) {
-        if (!ec) {
-          foscam_api::Header header;
-          baio::const_buffer buf_rest;
-          header = read<foscam_api::Header>(baio::buffer(*header_buf));
-
-          HandleEvent(header);
-        } else {
-          low_level_api_socket_.close();
-        }
-      });
+void Foscam::CloseConnection() {
+  boost::system::error_code ec;
+  low_level_api_socket_.close(ec);
+  connected_ = false;
 }
 
-void Foscam::HandleEvent(foscam_api::Header header) {
+void Foscam::Send(std::vector<uint8_t> message, bool last) {
   auto self(shared_from_this());
+  strand_.post([this, self, message, last]() mutable {
+    disconnecting_ = disconnecting_ || last;
+    send_queue_.push_back(std::move(message));
+    if (send_queue_.size() == 1) {
+      WriteNext();
+    }
+  });
+}
 
-  switch (header.type) {
-    case foscam_api::Command::VIDEO_ON_REPLY: {
-      auto reply_buf = std::make_shared<std::vector<uint8_t> >(header.size);
-
-      baio::async_read(
-          low_level_api_socket_,
-          baio::buffer(*reply_buf),
-          [this, self, header, reply_buf](boost::system::error_code ec,
-                                          std::size_t) {
-            if (!ec) {
-              foscam_api::VideoOnReply reply;
-              baio::const_buffer buf_rest;
-              reply = read<foscam_api::VideoOnReply>(baio::buffer(*reply_buf));
+void Foscam::WriteNext() {
+  auto self(shared_from_this());
 
-              if (reply.failed) {
-                throw FoscamException("Failed to enable video.");
+  baio::async_write(
+      low_level_api_socket_, baio::buffer(send_queue_.front()),
+      baio::bind_executor(strand_,
+          [this, self](boost::system::error_code ec, std::size_t) {
+            send_queue_.pop_front();
+            if (ec) {
+              send_queue_.clear();
+              if (low_level_api_socket_.is_open()) {
+                FailConnection("Write failed: " + ec.message());
               }
+            } else if (!send_queue_.empty()) {
+              WriteNext();
+            } else if (disconnecting_) {
+              CloseConnection();
+            }
+          }));
+}
 
-              video_on_reply_cond_.notify_one();
+void Foscam::SetStreamLimits(const BufferLimits & limits) {
+  stream_limits_ = limits;
+}
 
-              // Ready for another event
-              ReadHeader();
-            } else {
-              low_level_api_socket_.close();
-            }
-          });
-      break;
-    }
+void Foscam::SetAudioResampler(AudioTranscoder::Resampler resampler) {
+  audio_resampler_ = resampler;
+}
 
-    case foscam_api::Command::AUDIO_ON_REPLY: {
-      auto reply_buf = std::make_shared<std::vector<uint8_t> >(header.size);
+auto Foscam::CreateStream(RemuxSession::Mode mode) -> std::unique_ptr<Stream>
+{
+  std::lock_guard<std::mutex> lock(session_mutex_);
+  auto session = GetSessionLocked(mode);
+
+  // Low latency viewers join at the next keyframe rather than replaying the
+  // last GOP, which would keep them a GOP behind for good
+  if (mode == RemuxSession::Mode::LOW_LATENCY) {
+    BufferLimits limits = stream_limits_;
+    limits.max_delay = LOW_LATENCY_MAX_DELAY;
+    return std::make_unique<Stream>(session, limits,
+                                    BroadcastRing::Start::NEXT_KEYFRAME);
+  }
+  return std::make_unique<Stream>(session, stream_limits_,
+                                  BroadcastRing::Start::LAST_KEYFRAME);
+}
 
-      baio::async_read(
-          low_level_api_socket_,
-          baio::buffer(*reply_buf),
-          [this, self, header, reply_buf](boost::system::error_code ec,
-                                          std::size_t) {
-            if (!ec) {
-              foscam_api::AudioOnReply reply;
-              reply = read<foscam_api::AudioOnReply>(baio::buffer(*reply_buf));
+std::shared_ptr<HlsSegmenter> Foscam::GetHlsSegmenter() {
+  std::lock_guard<std::mutex> lock(session_mutex_);
+  if (!hls_segmenter_) {
+    hls_segmenter_ = std::make_shared<HlsSegmenter>(
+        worker_pool_, GetSessionLocked(RemuxSession::Mode::GOP));
+  }
+  return hls_segmenter_;
+}
 
-              if (reply.failed) {
-                throw FoscamException("Failed to enable video.");
-              }
+std::shared_ptr<HlsSegmenter> Foscam::hls_segmenter() {
+  std::lock_guard<std::mutex> lock(session_mutex_);
+  return hls_segmenter_;
+}
+
+void Foscam::StartRecording(const RecorderConfig & config) {
+  std::lock_guard<std::mutex> lock(session_mutex_);
+  recorder_.reset();
+  recorder_ = std::make_shared<Recorder>(
+      worker_pool_, GetSessionLocked(RemuxSession::Mode::GOP), config);
+}
 
-              audio_on_ = true;
-              audio_on_reply_cond_.notify_one();
+bool Foscam::connected() const {
+  return connected_;
+}
+
+std::shared_ptr<Recorder> Foscam::recorder() {
+  std::lock_guard<std::mutex> lock(session_mutex_);
+  return recorder_;
+}
 
-              // Ready for another event
-              ReadHeader();
-            } else {
-              low_level_api_socket_.close();
+auto Foscam::GetSessionLocked(RemuxSession::Mode mode)
+    -> std::shared_ptr<RemuxSession> {
+  auto & weak_session = mode == RemuxSession::Mode::LOW_LATENCY ?
+      low_latency_session_ : session_;
+  auto session = weak_session.lock();
+  if (!session) {
+    std::shared_ptr<AudioTranscoder> audio_transcoder;
+    if (audio_on_) {
+      audio_transcoder = audio_transcoder_.lock();
+      if (!audio_transcoder) {
+        audio_transcoder = std::make_shared<AudioTranscoder>(
+            worker_pool_, audio_ring_, stream_limits_, audio_resampler_);
+        audio_transcoder_ = audio_transcoder;
+      }
+    }
+    session = std::make_shared<RemuxSession>(
+        worker_pool_, video_ring_, audio_transcoder, mode, stream_limits_,
+        parameter_sets_, framerate_);
+    weak_session = session;
+  }
+  return session;
+}
+
+void Foscam::Receive() {
+  auto self(shared_from_this());
+
+  low_level_api_socket_.async_read_some(
+      baio::buffer(receive_buffer_) + receive_end_,
+      baio::bind_executor(strand_, MakeCustomAllocHandler(
+          read_handler_memory_,
+          [this, self](boost::system::error_code ec, std::size_t length) {
+            if (!ec) {
+              receive_end_ += length;
+              ParseMessages();
+            } else if (low_level_api_socket_.is_open() && !disconnecting_) {
+              FailConnection("Read failed: " + ec.message());
             }
-          });
+          })));
+}
+
+void Foscam::ParseMessages() {
+  // Handle every complete message received so far
+  while (receive_end_ - receive_begin_ >= HEADER_SIZE) {
+    const uint8_t * message = receive_buffer_.data() + receive_begin_;
+    foscam_api::Header header;
+    try {
+      header = foscam_api::Decode<foscam_api::Header>(message, HEADER_SIZE);
+    } catch (ProtocolException & ex) {
+      // Message boundaries are lost, nothing after this can be trusted
+      FailConnection(ex.what());
+      return;
+    }
+    if (header.size > MAX_MESSAGE_SIZE) {
+      FailConnection("Message of " + std::to_string(header.size) +
+                     " bytes received.");
+      return;
+    }
+    size_t message_size = HEADER_SIZE + header.size;
+
+    if (receive_end_ - receive_begin_ < message_size) {
+      if (message_size > receive_buffer_.size() / 2) {
+        ReadLargeMessage(header);
+        return;
+      }
       break;
     }
 
-    case foscam_api::Command::VIDEO_DATA: {
-      auto video_data_buf =
-          std::make_shared<std::vector<uint8_t> >(header.size);
+    HandleMessage(header, message + HEADER_SIZE);
+    receive_begin_ += message_size;
+  }
+
+  // Move the partial message, if any, to the front and read more
+  memmove(receive_buffer_.data(), receive_buffer_.data() + receive_begin_,
+          receive_end_ - receive_begin_);
+  receive_end_ -= receive_begin_;
+  receive_begin_ = 0;
+
+  Receive();
+}
+
+void Foscam::ReadLargeMessage(foscam_api::Header header) {
+  auto self(shared_from_this());
+
+  // Read the rest of the payload straight into its packet
+  auto packet = packet_pool_->Acquire(header.size);
+  size_t received = receive_end_ - receive_begin_ - HEADER_SIZE;
+  memcpy(packet->data.data(),
+         receive_buffer_.data() + receive_begin_ + HEADER_SIZE, received);
+  receive_begin_ = 0;
+  receive_end_ = 0;
 
-      baio::async_read(
-          low_level_api_socket_,
-          baio::buffer(*video_data_buf),
-          [this, self, video_data_buf](boost::system::error_code ec,
+  baio::async_read(
+      low_level_api_socket_,
+      baio::buffer(packet->data) + received,
+      baio::bind_executor(strand_, MakeCustomAllocHandler(
+          read_handler_memory_,
+          [this, self, header, packet](boost::system::error_code ec,
                                        std::size_t) {
             if (!ec) {
-              for (auto stream: active_streams_) {
-                stream->video_buffer_.push(video_data_buf->data(),
-                                          video_data_buf->size());
+              if (header.type == foscam_api::Command::VIDEO_DATA) {
+                PublishVideoPacket(packet);
+              } else {
+                HandleMessage(header, packet->data.data());
               }
 
-              // Ready for another event
-              ReadHeader();
-            } else {
-              low_level_api_socket_.close();
+              Receive();
+            } else if (low_level_api_socket_.is_open() && !disconnecting_) {
+              FailConnection("Read failed: " + ec.message());
             }
-          });
+          })));
+}
+
+void Foscam::HandleMessage(const foscam_api::Header & header,
+                           const uint8_t * payload) {
+  // The message boundaries still hold, only this one is lost
+  try {
+    DispatchMessage(header, payload);
+  } catch (std::exception & ex) {
+    std::cerr << "Dropped a message from " << host_ << ": " << ex.what()
+              << std::endl;
+  }
+}
+
+void Foscam::DispatchMessage(const foscam_api::Header & header,
+                             const uint8_t * payload) {
+  switch (header.type) {
+    case foscam_api::Command::VIDEO_ON_REPLY: {
+      auto reply = foscam_api::Decode<foscam_api::VideoOnReply>(payload,
+                                                          header.size);
+      if (reply.failed) {
+        FinishStart(std::make_exception_ptr(
+            FoscamException("Failed to enable video.")));
+        break;
+      }
+
+      StartStepDone();
+      break;
+    }
+
+    case foscam_api::Command::AUDIO_ON_REPLY: {
+      auto reply = foscam_api::Decode<foscam_api::AudioOnReply>(payload,
+                                                          header.size);
+      if (reply.failed) {
+        FinishStart(std::make_exception_ptr(
+            FoscamException("Failed to enable audio.")));
+        break;
+      }
+
+      audio_on_ = true;
+      StartStepDone();
+      break;
+    }
+
+    case foscam_api::Command::VIDEO_DATA: {
+      auto video_packet = packet_pool_->Acquire(header.size);
+      memcpy(video_packet->data.data(), payload, header.size);
+      PublishVideoPacket(video_packet);
       break;
     }
 
     case foscam_api::Command::AUDIO_DATA: {
-      auto audio_data_header_buf = std::make_shared<std::vector<uint8_t> >(
-          get_size<foscam_api::AudioDataHeader>());
-      size_t audio_data_size = header.size - audio_data_header_buf->size();
-
-      baio::async_read(
-          low_level_api_socket_,
-          baio::buffer(*audio_data_header_buf),
-          [this, self, audio_data_header_buf, audio_data_size](
-              boost::system::error_code ec, std::size_t) {
-            if (!ec) {
-              foscam_api::AudioDataHeader audio_data_header;
-              audio_data_header = read<foscam_api::AudioDataHeader>(
-                  baio::buffer(*audio_data_header_buf));
-
-              auto audio_data_buf =
-                  std::make_shared<std::vector<uint8_t> >(audio_data_size);
-              baio::async_read(low_level_api_socket_,
-                               baio::buffer(*audio_data_buf),
-                  [this, self, audio_data_buf](boost::system::error_code ec,
-                                               std::size_t) {
-                    if (!ec) {
-                      for (auto stream: active_streams_) {
-                        stream->audio_buffer_.push(audio_data_buf->data(),
-                                                  audio_data_buf->size());
-                      }
-
-                      // Ready for another event
-                      ReadHeader();
-                    } else {
-                      low_level_api_socket_.close();
-                    }
-                  });
-            } else {
-              low_level_api_socket_.close();
-            }
-          });
+      if (header.size < AUDIO_DATA_HEADER_SIZE) {
+        throw FoscamException("Invalid audio data size.");
+      }
+
+      size_t audio_data_size = header.size - AUDIO_DATA_HEADER_SIZE;
+      auto audio_packet = packet_pool_->Acquire(audio_data_size);
+      memcpy(audio_packet->data.data(), payload + AUDIO_DATA_HEADER_SIZE,
+             audio_data_size);
+      audio_packet->timestamp = std::chrono::steady_clock::now();
+      audio_packet->keyframe = true;
+      audio_ring_.push(audio_packet);
+      break;
+    }
+
+    case foscam_api::Command::MOTION_DETECTION_ALERT: {
+      // The payload layout is unknown, the alert itself is the event
+      auto event_recorder = recorder();
+      if (event_recorder) {
+        event_recorder->TriggerEvent();
+      }
       break;
     }
 
@@ -724,5 +766,20 @@ void Foscam::HandleEvent(foscam_api::Header header) {
   }
 }
 
+void Foscam::PublishVideoPacket(MutableMediaPacketPtr packet) {
+  packet->timestamp = std::chrono::steady_clock::now();
+  auto info = ParseAccessUnit(packet->data.data(), packet->data.size());
+  packet->keyframe = info.keyframe;
+  if (info.has_sps || info.has_pps) {
+    std::vector<uint8_t> parameter_sets;
+    if (ExtractParameterSets(packet->data.data(), packet->data.size(),
+                             parameter_sets)) {
+      std::lock_guard<std::mutex> lock(session_mutex_);
+      parameter_sets_.swap(parameter_sets);
+    }
+  }
+  video_ring_.push(packet);
+}
+
 }  // namespace foscam_hd
 
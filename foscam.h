@@ -1,16 +1,28 @@
 #ifndef FOSCAM_H_
 #define FOSCAM_H_
 
-#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
-#include <unordered_set>
+#include <vector>
 
 #include <boost/asio.hpp>
-
-#include "ffmpeg_wrapper.h"
-#include "pipe_buffer.h"
+#include <boost/asio/steady_timer.hpp>
+
+#include "audio_transcoder.h"
+#include "broadcast_ring.h"
+#include "buffer_limits.h"
+#include "handler_allocator.h"
+#include "hls_segmenter.h"
+#include "packet_pool.h"
+#include "recorder.h"
+#include "remux_session.h"
+#include "worker_pool.h"
 
 namespace foscam_api {
   struct Header;
@@ -28,57 +40,146 @@ class FoscamException : public std::exception {
   std::string what_;
 };
 
+class CgiRequest;
+
 class Foscam : public std::enable_shared_from_this<Foscam> {
  public:
+  // Null on success
+  using StartHandler = std::function<void(std::exception_ptr error)>;
+
   class Stream {
    public:
-    Stream(Foscam & parent, const int framerate, bool audio_on);
+    struct Stats {
+      DropStats video_input;
+      DropStats audio_input;
+      DropStats output;
+      // From the camera packet starting a fragment to the fragment being
+      // handed to the HTTP server
+      uint64_t fragments = 0;
+      std::chrono::microseconds mean_latency{0};
+      std::chrono::microseconds max_latency{0};
+      RemuxSession::InterleaveStats interleave;
+    };
+
+    Stream(std::shared_ptr<RemuxSession> session,
+           const BufferLimits & limits, BroadcastRing::Start start);
     ~Stream();
 
     unsigned int GetVideoStreamData(uint8_t * data, size_t data_length);
+    Stats GetStats() const;
 
    private:
-    friend class Foscam;
-
-    Foscam & parent_;
-
-    PipeBuffer video_buffer_;
-    PipeBuffer audio_buffer_;
-    PipeBuffer video_stream_buffer_;
-
-    ffmpeg_wrapper::FFMpegWrapper remuxer_;
+    MediaPacketPtr WaitFragment();
+
+    std::shared_ptr<RemuxSession> session_;
+    RemuxSession::InitSegmentPtr init_segment_;
+    size_t init_segment_offset_;
+    BroadcastRing::Reader fragment_reader_;
+    Notifier fragment_ready_;
+    MediaPacketPtr fragment_;
+    size_t fragment_offset_;
+    uint64_t fragments_;
+    std::chrono::microseconds total_latency_;
+    std::chrono::microseconds max_latency_;
   };
 
   Foscam(const std::string & host, unsigned int port, unsigned int uid,
          const std::string & user, const std::string & password,
-         boost::asio::io_service & io_service);
+         boost::asio::io_service & io_service, WorkerPool & worker_pool);
   virtual ~Foscam();
 
-  void Connect();
+  // Connects, reads the stream settings and turns video and audio on
+  // without blocking. The steps that can overlap do. The handler is called
+  // once on the camera's strand, at the latest when the timeout runs out,
+  // and the connection is closed when it fails.
+  void Start(std::chrono::milliseconds timeout, StartHandler handler);
   void Disconnect();
-  bool VideoOn();
-  bool AudioOn();
-
-  std::unique_ptr<Stream> CreateStream();
+  // False until started, and again once the connection is lost or closed
+  bool connected() const;
+
+  void SetStreamLimits(const BufferLimits & limits);
+  void SetAudioResampler(AudioTranscoder::Resampler resampler);
+  std::unique_ptr<Stream> CreateStream(
+      RemuxSession::Mode mode = RemuxSession::Mode::GOP);
+  // Started by the first HLS request, then kept for the next ones
+  std::shared_ptr<HlsSegmenter> GetHlsSegmenter();
+  // Null until GetHlsSegmenter is first called
+  std::shared_ptr<HlsSegmenter> hls_segmenter();
+  // Records the GOP stream until the camera goes away
+  void StartRecording(const RecorderConfig & config);
+  // Null when not recording
+  std::shared_ptr<Recorder> recorder();
 
  private:
-  void ReadHeader();
-  void HandleEvent(foscam_api::Header header);
+  void OpenLowLevelApi();
+  void QueryFramerate(
+      const boost::asio::ip::tcp::resolver::results_type & endpoints);
+  void StartStepDone();
+  void FinishStart(std::exception_ptr error);
+  // Logs the error and fails the start if still running
+  void FailConnection(const std::string & error);
+  void CloseConnection();
+  // Commands are written in order on the strand. The connection is closed
+  // once the last one is written.
+  void Send(std::vector<uint8_t> message, bool last = false);
+  void WriteNext();
+  void Receive();
+  void ParseMessages();
+  void ReadLargeMessage(foscam_api::Header header);
+  // Drops a message that fails to parse
+  void HandleMessage(const foscam_api::Header & header,
+                     const uint8_t * payload);
+  void DispatchMessage(const foscam_api::Header & header,
+                       const uint8_t * payload);
+  void PublishVideoPacket(MutableMediaPacketPtr packet);
+  std::shared_ptr<RemuxSession> GetSessionLocked(RemuxSession::Mode mode);
 
   boost::asio::io_service & io_service_;
+  WorkerPool & worker_pool_;
+  // Runs the handlers of the connection, which may be on any thread of the
+  // io_service
+  boost::asio::io_service::strand strand_;
   boost::asio::ip::tcp::socket low_level_api_socket_;
   const std::string host_;
   const std::string port_;
   unsigned int uid_;
   const std::string user_;
   const std::string password_;
-  int framerate_;
-  std::mutex reply_cond_mutex_;
-  std::condition_variable video_on_reply_cond_;
-  std::condition_variable audio_on_reply_cond_;
+  // Seeds the remuxer's frame duration
+  unsigned int framerate_;
   bool audio_on_;
-
-  std::unordered_set<Stream *> active_streams_;
+  BufferLimits stream_limits_;
+  AudioTranscoder::Resampler audio_resampler_;
+
+  // Receive path state, reused for every message
+  std::vector<uint8_t> receive_buffer_;
+  size_t receive_begin_;
+  size_t receive_end_;
+  HandlerMemory read_handler_memory_;
+  std::deque<std::vector<uint8_t>> send_queue_;
+  std::atomic<bool> connected_;
+  bool disconnecting_;
+  std::shared_ptr<PacketPool> packet_pool_;
+
+  // Start state, on the strand until the handler is called
+  boost::asio::ip::tcp::resolver resolver_;
+  boost::asio::steady_timer start_timer_;
+  StartHandler start_handler_;
+  int start_steps_left_;
+  std::vector<std::shared_ptr<CgiRequest>> cgi_requests_;
+
+  BroadcastRing video_ring_;
+  BroadcastRing audio_ring_;
+
+  std::mutex session_mutex_;
+  std::weak_ptr<RemuxSession> session_;
+  std::weak_ptr<RemuxSession> low_latency_session_;
+  std::shared_ptr<HlsSegmenter> hls_segmenter_;
+  std::shared_ptr<Recorder> recorder_;
+  // Encodes the audio once for every consumer while any is alive
+  std::weak_ptr<AudioTranscoder> audio_transcoder_;
+  // Latest SPS/PPS, to prime new sessions
+  std::vector<uint8_t> parameter_sets_;
 
   Foscam(const Foscam &) = delete;
   Foscam(Foscam &&) = delete;
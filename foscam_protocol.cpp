@@ -0,0 +1,31 @@
+#include "foscam_protocol.h"
+
+namespace foscam_api {
+
+static_assert(wire_size<Header>() == 12, "Unexpected header size");
+static_assert(wire_size<CloseConnection>() == 129,
+              "Unexpected close connection size");
+static_assert(wire_size<VideoOnRequest>() == 161,
+              "Unexpected video on request size");
+static_assert(wire_size<AudioOnRequest>() == 161,
+              "Unexpected audio on request size");
+static_assert(wire_size<VideoOnReply>() == 36,
+              "Unexpected video on reply size");
+static_assert(wire_size<AudioOnReply>() == 36,
+              "Unexpected audio on reply size");
+static_assert(wire_size<AudioDataHeader>() == 36,
+              "Unexpected audio data header size");
+
+}  // namespace foscam_api
+
+namespace foscam_hd {
+
+ProtocolException::ProtocolException(const std::string & what)
+    : what_("ProtocolException: " + what) {
+}
+
+const char* ProtocolException::what() const noexcept {
+  return what_.c_str();
+}
+
+}  // namespace foscam_hd
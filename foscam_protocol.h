@@ -0,0 +1,340 @@
+#ifndef FOSCAM_PROTOCOL_H_
+#define FOSCAM_PROTOCOL_H_
+
+#include <endian.h>
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <boost/fusion/include/define_struct.hpp>
+#include <boost/fusion/include/for_each.hpp>
+#include <boost/fusion/include/size.hpp>
+#include <boost/fusion/include/value_at.hpp>
+
+namespace foscam_hd {
+
+class ProtocolException : public std::exception {
+ public:
+  explicit ProtocolException(const std::string & what);
+
+  const char* what() const noexcept override;
+
+ private:
+  std::string what_;
+};
+
+}  // namespace foscam_hd
+
+namespace foscam_api {
+
+enum class Command : uint32_t {
+    VIDEO_ON_REQUEST = 0x00,
+    CLOSE_CONNECTION = 0x01,
+    AUDIO_ON_REQUEST = 0x02,
+    VIDEO_ON_REPLY = 0x10,
+    AUDIO_ON_REPLY = 0x12,
+    VIDEO_DATA = 0x1a,
+    AUDIO_DATA = 0x1b,
+    MOTION_DETECTION_ALERT = 0x6f,
+
+#if 0
+// User to cam
+AUDIO_OFF = 0x03,
+SPEAKER_ON = 0x04,
+SPEAKER_OFF = 0x05,
+
+TALK_AUDIO_DATA = 0x06,
+LOGIN_REQ = 0x0c,
+LOGIN_CHECK = 0x0f,
+
+// Cam to user
+SPEAKER_ON_REPLY = 0x14,
+SPEAKER_OFF_REPLY = 0x15,
+
+LOGIN_CHECK_REPLY = 0x1d,
+PTZ_INFO = 0x64,
+PRESET_POINT_UNCHANGED = 0x6A,
+CRUISES_LIST_CHANGED = 0x6B,
+SHOW_MIRROR_FLIP = 0x6C,
+SHOW_COLOR_ADJUST_VALUES = 0x6E,
+SHOWE_POWER_FREQ = 0x70,
+STREAM_SELECT_REPLY = 0x71
+#endif
+};
+
+using Magic = std::integral_constant<uint32_t, 0x43534f46>;  // FOSC
+
+enum class Videostream : uint8_t {
+  MAIN = 0,
+  SUB = 1
+};
+
+template<size_t N>
+struct FixedString {
+  static const size_t size = N;
+
+  char str[N];
+};
+
+template<size_t N>
+struct Reserved {
+  static const size_t size = N;
+};
+
+}  // namespace foscam_api
+
+BOOST_FUSION_DEFINE_STRUCT(
+  (foscam_api), Header,
+  (foscam_api::Command, type)
+  (foscam_api::Magic, magic)
+  (uint32_t, size)
+)
+
+BOOST_FUSION_DEFINE_STRUCT(
+  (foscam_api),
+  CloseConnection,
+  (foscam_api::Reserved<1>, reserved)
+  (foscam_api::FixedString<64>, username)
+  (foscam_api::FixedString<64>, password)
+)
+
+BOOST_FUSION_DEFINE_STRUCT(
+  (foscam_api),
+  VideoOnRequest,
+  (foscam_api::Videostream, stream)
+  (foscam_api::FixedString<64>, username)
+  (foscam_api::FixedString<64>, password)
+  (uint32_t, uid)
+  (foscam_api::Reserved<28>, reserved)
+)
+
+BOOST_FUSION_DEFINE_STRUCT(
+  (foscam_api), VideoOnReply,
+  (uint8_t, failed)
+  (foscam_api::Reserved<35>, reserved)
+)
+
+BOOST_FUSION_DEFINE_STRUCT(
+  (foscam_api),
+  AudioOnRequest,
+  (foscam_api::Reserved<1>, reserved0)
+  (foscam_api::FixedString<64>, username)
+  (foscam_api::FixedString<64>, password)
+  (foscam_api::Reserved<32>, reserved1)
+)
+
+BOOST_FUSION_DEFINE_STRUCT(
+  (foscam_api), AudioOnReply,
+  (uint8_t, failed)
+  (foscam_api::Reserved<35>, reserved)
+)
+
+BOOST_FUSION_DEFINE_STRUCT(
+  (foscam_api), AudioDataHeader,
+  (foscam_api::Reserved<36>, reserved)
+)
+
+namespace foscam_api {
+
+namespace endian {
+
+template<class T> T ntoh(T) = delete;
+inline uint32_t ntoh(uint32_t v) { return le32toh(v); }
+inline uint16_t ntoh(uint16_t v) { return le16toh(v); }
+inline uint8_t ntoh(uint8_t v) { return v; }
+inline int8_t ntoh(int8_t v) { return v; }
+inline char ntoh(char v) { return v; }
+
+template<class T> T hton(T) = delete;
+inline uint32_t hton(uint32_t v) { return htole32(v); }
+inline uint16_t hton(uint16_t v) { return htole16(v); }
+inline uint8_t hton(uint8_t v) { return v; }
+inline int8_t hton(int8_t v) { return v; }
+inline char hton(char v) { return v; }
+
+}  // namespace endian
+
+// Size of a message or field on the wire, known at compile time
+template<class T, class Enable = void>
+struct WireSize;
+
+template<class T>
+struct WireSize<T, typename std::enable_if<std::is_integral<T>::value>::type>
+    : std::integral_constant<size_t, sizeof(T)> {
+};
+
+template<class T>
+struct WireSize<T, typename std::enable_if<std::is_enum<T>::value>::type>
+    : std::integral_constant<
+          size_t, sizeof(typename std::underlying_type<T>::type)> {
+};
+
+template<class T, T v>
+struct WireSize<std::integral_constant<T, v> >
+    : std::integral_constant<size_t, sizeof(T)> {
+};
+
+template<size_t N>
+struct WireSize<Reserved<N> > : std::integral_constant<size_t, N> {
+};
+
+template<size_t N>
+struct WireSize<FixedString<N> > : std::integral_constant<size_t, N> {
+};
+
+template<class T, size_t I = 0,
+         size_t N = boost::fusion::result_of::size<T>::value>
+struct FieldsWireSize
+    : std::integral_constant<
+          size_t,
+          WireSize<typename boost::fusion::result_of::value_at_c<
+              T, I>::type>::value +
+          FieldsWireSize<T, I + 1, N>::value> {
+};
+
+template<class T, size_t N>
+struct FieldsWireSize<T, N, N> : std::integral_constant<size_t, 0> {
+};
+
+template<class T>
+struct WireSize<T, typename std::enable_if<
+    boost::fusion::traits::is_sequence<T>::value>::type>
+    : FieldsWireSize<T> {
+};
+
+template<class T>
+constexpr size_t wire_size() {
+  return WireSize<T>::value;
+}
+
+namespace detail {
+
+// The fields are laid out back to back, so the walk over a message unrolls
+// into fixed offset copies; strings and reserved fields move in bulk. The
+// cursor is shared as fusion::for_each copies its visitor.
+struct Decoder {
+  const uint8_t *& in;
+
+  template<class T>
+  auto operator()(T & val) const ->
+  typename std::enable_if<std::is_integral<T>::value>::type {
+    T wire;
+    memcpy(&wire, in, sizeof(T));
+    val = endian::ntoh(wire);
+    in += sizeof(T);
+  }
+
+  template<class T>
+  auto operator()(T & val) const ->
+  typename std::enable_if<std::is_enum<T>::value>::type {
+    typename std::underlying_type<T>::type v;
+    (*this)(v);
+    val = static_cast<T>(v);
+  }
+
+  template<class T, T v>
+  void operator()(std::integral_constant<T, v>) const {
+    T val;
+    (*this)(val);
+    if (val != v) {
+      throw foscam_hd::ProtocolException("Invalid integral constant.");
+    }
+  }
+
+  template<size_t N>
+  void operator()(Reserved<N>) const {
+    in += N;
+  }
+
+  template<size_t N>
+  void operator()(FixedString<N> & val) const {
+    memcpy(val.str, in, N);
+    in += N;
+  }
+
+  template<class T>
+  auto operator()(T & val) const ->
+  typename std::enable_if<boost::fusion::traits::is_sequence<T>::value>::type {
+    boost::fusion::for_each(val, *this);
+  }
+};
+
+struct Encoder {
+  uint8_t *& out;
+
+  template<class T>
+  auto operator()(T const& val) const ->
+  typename std::enable_if<std::is_integral<T>::value>::type {
+    T wire = endian::hton(val);
+    memcpy(out, &wire, sizeof(T));
+    out += sizeof(T);
+  }
+
+  template<class T>
+  auto operator()(T const& val) const ->
+  typename std::enable_if<std::is_enum<T>::value>::type {
+    (*this)(static_cast<typename std::underlying_type<T>::type>(val));
+  }
+
+  template<class T, T v>
+  void operator()(std::integral_constant<T, v>) const {
+    (*this)(v);
+  }
+
+  template<size_t N>
+  void operator()(Reserved<N>) const {
+    memset(out, 0, N);
+    out += N;
+  }
+
+  template<size_t N>
+  void operator()(FixedString<N> const& val) const {
+    memcpy(out, val.str, N);
+    out += N;
+  }
+
+  template<class T>
+  auto operator()(T const& val) const ->
+  typename std::enable_if<boost::fusion::traits::is_sequence<T>::value>::type {
+    boost::fusion::for_each(val, *this);
+  }
+};
+
+}  // namespace detail
+
+// Decodes a T from the start of data
+template<class T>
+T Decode(const uint8_t * data, size_t size) {
+  if (size < wire_size<T>()) {
+    throw foscam_hd::ProtocolException("Message too short.");
+  }
+  T val;
+  detail::Decoder{data}(val);
+  return val;
+}
+
+// Encodes val at the start of data, which must hold wire_size<T>() bytes
+template<class T>
+void Encode(const T & val, uint8_t * data) {
+  detail::Encoder{data}(val);
+}
+
+// Header followed by the request
+template<class T>
+std::vector<uint8_t> EncodeCommand(Command type, const T & request) {
+  Header header;
+  header.type = type;
+  header.size = wire_size<T>();
+
+  std::vector<uint8_t> message(wire_size<Header>() + wire_size<T>());
+  Encode(header, message.data());
+  Encode(request, message.data() + wire_size<Header>());
+  return message;
+}
+
+}  // namespace foscam_api
+
+#endif  // FOSCAM_PROTOCOL_H_
@@ -0,0 +1,307 @@
+#include "h264_parser.h"
+
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define H264_PARSER_X86
+#endif
+
+namespace {
+
+using foscam_hd::NalUnit;
+using foscam_hd::NalUnitType;
+
+const uint8_t * FindStartCodeScalar(const uint8_t * begin,
+                                    const uint8_t * end) {
+  for (const uint8_t * p = begin; p + 3 <= end; p++) {
+    // Skip ahead by 3 while the third byte rules out a start code here and
+    // at the two previous positions
+    if (p[2] > 1) {
+      p += 2;
+    } else if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+      return p;
+    }
+  }
+  return end;
+}
+
+#ifdef H264_PARSER_X86
+
+#ifdef __SSE2__
+const uint8_t * FindStartCodeSse2(const uint8_t * begin,
+                                  const uint8_t * end) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi8(1);
+  const uint8_t * p = begin;
+  for (; p + 2 + 16 <= end; p += 16) {
+    // Match 00 00 01 at each of the 16 positions at once
+    __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 1));
+    __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 2));
+    __m128i match = _mm_and_si128(
+        _mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+        _mm_cmpeq_epi8(b2, one));
+    int mask = _mm_movemask_epi8(match);
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return FindStartCodeScalar(p, end);
+}
+#endif  // __SSE2__
+
+__attribute__((target("avx2")))
+const uint8_t * FindStartCodeAvx2(const uint8_t * begin,
+                                  const uint8_t * end) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi8(1);
+  const uint8_t * p = begin;
+  for (; p + 2 + 32 <= end; p += 32) {
+    __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 1));
+    __m256i b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 2));
+    __m256i match = _mm256_and_si256(
+        _mm256_and_si256(_mm256_cmpeq_epi8(b0, zero),
+                         _mm256_cmpeq_epi8(b1, zero)),
+        _mm256_cmpeq_epi8(b2, one));
+    unsigned int mask = _mm256_movemask_epi8(match);
+    if (mask) {
+      return p + __builtin_ctz(mask);
+    }
+  }
+  return FindStartCodeScalar(p, end);
+}
+
+#endif  // H264_PARSER_X86
+
+typedef const uint8_t * (*FindStartCodeFunc)(const uint8_t *,
+                                             const uint8_t *);
+
+FindStartCodeFunc SelectFindStartCode() {
+#ifdef H264_PARSER_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return FindStartCodeAvx2;
+  }
+#ifdef __SSE2__
+  return FindStartCodeSse2;
+#endif
+#endif
+  return FindStartCodeScalar;
+}
+
+const FindStartCodeFunc find_start_code = SelectFindStartCode();
+
+// Exp-Golomb reader over the RBSP of a NAL unit
+class BitReader {
+ public:
+  explicit BitReader(const NalUnit & nal)
+      : bit_(0), overrun_(false) {
+    // Drop the header byte and the emulation prevention bytes
+    rbsp_.reserve(nal.size);
+    unsigned int zeros = 0;
+    for (size_t idx = 1; idx < nal.size; idx++) {
+      if (zeros >= 2 && nal.data[idx] == 3) {
+        zeros = 0;
+        continue;
+      }
+      zeros = nal.data[idx] == 0 ? zeros + 1 : 0;
+      rbsp_.push_back(nal.data[idx]);
+    }
+  }
+
+  unsigned int ReadBits(unsigned int count) {
+    unsigned int value = 0;
+    for (unsigned int idx = 0; idx < count; idx++) {
+      value = (value << 1) | ReadBit();
+    }
+    return value;
+  }
+
+  unsigned int ReadUe() {
+    unsigned int leading_zeros = 0;
+    while (!ReadBit() && !overrun_ && leading_zeros < 32) {
+      leading_zeros++;
+    }
+    if (leading_zeros >= 32) {
+      overrun_ = true;
+      return 0;
+    }
+    return (1u << leading_zeros) - 1 + ReadBits(leading_zeros);
+  }
+
+  int ReadSe() {
+    unsigned int value = ReadUe();
+    return value & 1 ? static_cast<int>((value + 1) / 2) :
+        -static_cast<int>(value / 2);
+  }
+
+  bool overrun() const {
+    return overrun_;
+  }
+
+ private:
+  unsigned int ReadBit() {
+    if (bit_ >= rbsp_.size() * 8) {
+      overrun_ = true;
+      return 0;
+    }
+    unsigned int value = (rbsp_[bit_ / 8] >> (7 - bit_ % 8)) & 1;
+    bit_++;
+    return value;
+  }
+
+  std::vector<uint8_t> rbsp_;
+  size_t bit_;
+  bool overrun_;
+};
+
+void SkipScalingList(BitReader & reader, unsigned int size) {
+  int last_scale = 8;
+  int next_scale = 8;
+  for (unsigned int idx = 0; idx < size; idx++) {
+    if (next_scale != 0) {
+      next_scale = (last_scale + reader.ReadSe() + 256) % 256;
+    }
+    last_scale = next_scale == 0 ? last_scale : next_scale;
+  }
+}
+
+}  // namespace
+
+namespace foscam_hd {
+
+const uint8_t * FindStartCode(const uint8_t * begin, const uint8_t * end) {
+  return find_start_code(begin, end);
+}
+
+AccessUnitInfo ParseAccessUnit(const uint8_t * data, size_t size) {
+  AccessUnitInfo info;
+  ForEachNalUnit(data, size, [&info](const NalUnit & nal) {
+    switch (nal.type) {
+      case NalUnitType::IDR_SLICE:
+        info.keyframe = true;
+        break;
+      case NalUnitType::SPS:
+        info.has_sps = true;
+        break;
+      case NalUnitType::PPS:
+        info.has_pps = true;
+        break;
+      default:
+        break;
+    }
+  });
+
+  return info;
+}
+
+bool ExtractParameterSets(const uint8_t * data, size_t size,
+                          std::vector<uint8_t> & parameter_sets) {
+  static const uint8_t START_CODE[] = {0, 0, 0, 1};
+
+  bool found = false;
+  ForEachNalUnit(data, size, [&](const NalUnit & nal) {
+    if (nal.type == NalUnitType::SPS || nal.type == NalUnitType::PPS) {
+      parameter_sets.insert(parameter_sets.end(), START_CODE,
+                            START_CODE + sizeof(START_CODE));
+      parameter_sets.insert(parameter_sets.end(), nal.data,
+                            nal.data + nal.size);
+      found = true;
+    }
+  });
+
+  return found;
+}
+
+bool ParseSps(const NalUnit & nal, SequenceParameterSet & sps) {
+  if (nal.type != NalUnitType::SPS) {
+    return false;
+  }
+
+  BitReader reader(nal);
+  sps.profile_idc = reader.ReadBits(8);
+  reader.ReadBits(8);  // constraint flags
+  sps.level_idc = reader.ReadBits(8);
+  reader.ReadUe();  // seq_parameter_set_id
+
+  unsigned int chroma_format_idc = 1;
+  bool separate_colour_plane = false;
+  switch (sps.profile_idc) {
+    case 100: case 110: case 122: case 244: case 44: case 83: case 86:
+    case 118: case 128: case 138: case 139: case 134: case 135: {
+      chroma_format_idc = reader.ReadUe();
+      if (chroma_format_idc == 3) {
+        separate_colour_plane = reader.ReadBits(1);
+      }
+      reader.ReadUe();  // bit_depth_luma_minus8
+      reader.ReadUe();  // bit_depth_chroma_minus8
+      reader.ReadBits(1);  // qpprime_y_zero_transform_bypass_flag
+      if (reader.ReadBits(1)) {
+        for (unsigned int idx = 0; idx < (chroma_format_idc == 3 ? 12 : 8);
+             idx++) {
+          if (reader.ReadBits(1)) {
+            SkipScalingList(reader, idx < 6 ? 16 : 64);
+          }
+        }
+      }
+      break;
+    }
+    default:
+      break;
+  }
+
+  reader.ReadUe();  // log2_max_frame_num_minus4
+  unsigned int pic_order_cnt_type = reader.ReadUe();
+  if (pic_order_cnt_type == 0) {
+    reader.ReadUe();  // log2_max_pic_order_cnt_lsb_minus4
+  } else if (pic_order_cnt_type == 1) {
+    reader.ReadBits(1);  // delta_pic_order_always_zero_flag
+    reader.ReadSe();  // offset_for_non_ref_pic
+    reader.ReadSe();  // offset_for_top_to_bottom_field
+    unsigned int cycle_length = reader.ReadUe();
+    for (unsigned int idx = 0; idx < cycle_length && !reader.overrun();
+         idx++) {
+      reader.ReadSe();
+    }
+  }
+  reader.ReadUe();  // max_num_ref_frames
+  reader.ReadBits(1);  // gaps_in_frame_num_value_allowed_flag
+
+  unsigned int width_in_mbs = reader.ReadUe() + 1;
+  unsigned int height_in_map_units = reader.ReadUe() + 1;
+  unsigned int frame_mbs_only = reader.ReadBits(1);
+  if (!frame_mbs_only) {
+    reader.ReadBits(1);  // mb_adaptive_frame_field_flag
+  }
+  reader.ReadBits(1);  // direct_8x8_inference_flag
+
+  unsigned int crop_left = 0;
+  unsigned int crop_right = 0;
+  unsigned int crop_top = 0;
+  unsigned int crop_bottom = 0;
+  if (reader.ReadBits(1)) {
+    crop_left = reader.ReadUe();
+    crop_right = reader.ReadUe();
+    crop_top = reader.ReadUe();
+    crop_bottom = reader.ReadUe();
+  }
+  if (reader.overrun()) {
+    return false;
+  }
+
+  unsigned int crop_unit_x = 1;
+  unsigned int crop_unit_y = 2 - frame_mbs_only;
+  if (!separate_colour_plane && chroma_format_idc != 0) {
+    crop_unit_x = chroma_format_idc == 3 ? 1 : 2;
+    crop_unit_y *= chroma_format_idc == 1 ? 2 : 1;
+  }
+
+  sps.width = width_in_mbs * 16 - crop_unit_x * (crop_left + crop_right);
+  sps.height = (2 - frame_mbs_only) * height_in_map_units * 16 -
+      crop_unit_y * (crop_top + crop_bottom);
+
+  return true;
+}
+
+}  // namespace foscam_hd
@@ -0,0 +1,80 @@
+#ifndef H264_PARSER_H_
+#define H264_PARSER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace foscam_hd {
+
+enum class NalUnitType : uint8_t {
+  SLICE = 1,
+  IDR_SLICE = 5,
+  SEI = 6,
+  SPS = 7,
+  PPS = 8,
+  AUD = 9
+};
+
+// NAL unit payload, starting at the NAL header and excluding start codes
+struct NalUnit {
+  NalUnitType type;
+  const uint8_t * data;
+  size_t size;
+};
+
+struct AccessUnitInfo {
+  bool keyframe = false;
+  bool has_sps = false;
+  bool has_pps = false;
+};
+
+struct SequenceParameterSet {
+  unsigned int profile_idc = 0;
+  unsigned int level_idc = 0;
+  unsigned int width = 0;
+  unsigned int height = 0;
+};
+
+// Returns the first 00 00 01 start code in [begin, end), or end. Uses AVX2
+// or SSE2 when available.
+const uint8_t * FindStartCode(const uint8_t * begin, const uint8_t * end);
+
+// Calls func(const NalUnit &) for each NAL unit of the Annex-B byte stream.
+template<typename Func>
+void ForEachNalUnit(const uint8_t * data, size_t size, Func func) {
+  const uint8_t * end = data + size;
+  const uint8_t * start_code = FindStartCode(data, end);
+  while (start_code != end) {
+    const uint8_t * nal = start_code + 3;
+    const uint8_t * next = FindStartCode(nal, end);
+    // Zeros before a start code are not part of the NAL unit
+    const uint8_t * nal_end = next;
+    while (nal_end > nal && nal_end[-1] == 0) {
+      nal_end--;
+    }
+    if (nal_end > nal) {
+      func(NalUnit{static_cast<NalUnitType>(nal[0] & 0x1f), nal,
+                   static_cast<size_t>(nal_end - nal)});
+    }
+    start_code = next;
+  }
+}
+
+// Frame type and parameter sets of one access unit, as sent by the camera
+// in a single video message. A keyframe contains an IDR slice, i.e. a
+// decoder can start from it.
+AccessUnitInfo ParseAccessUnit(const uint8_t * data, size_t size);
+
+// Appends the SPS and PPS NAL units found in the Annex-B byte stream to
+// parameter_sets, each with a 4 byte start code. Returns false if none.
+bool ExtractParameterSets(const uint8_t * data, size_t size,
+                          std::vector<uint8_t> & parameter_sets);
+
+// Parses the fields of an SPS NAL unit needed to describe the stream
+// without a decoder. Returns false on a truncated or unsupported SPS.
+bool ParseSps(const NalUnit & nal, SequenceParameterSet & sps);
+
+}  // namespace foscam_hd
+
+#endif  // H264_PARSER_H_
@@ -0,0 +1,111 @@
+#ifndef HANDLER_ALLOCATOR_H_
+#define HANDLER_ALLOCATOR_H_
+
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace foscam_hd {
+
+// Storage for the completion handler of a chain of asynchronous operations
+// where only one is outstanding at a time. Asio releases a handler's memory
+// before invoking it, so the next operation of the chain reuses the block.
+class HandlerMemory {
+ public:
+  HandlerMemory() : in_use_(false) {
+  }
+
+  void * allocate(size_t size) {
+    if (!in_use_ && size < sizeof(storage_)) {
+      in_use_ = true;
+      return &storage_;
+    }
+    return ::operator new(size);
+  }
+
+  void deallocate(void * pointer) {
+    if (pointer == &storage_) {
+      in_use_ = false;
+    } else {
+      ::operator delete(pointer);
+    }
+  }
+
+ private:
+  typename std::aligned_storage<1024>::type storage_;
+  bool in_use_;
+
+  HandlerMemory(const HandlerMemory &) = delete;
+  HandlerMemory & operator=(const HandlerMemory &) = delete;
+};
+
+template<typename T>
+class HandlerAllocator {
+ public:
+  typedef T value_type;
+
+  explicit HandlerAllocator(HandlerMemory & memory)
+      : memory_(memory) {
+  }
+
+  template<typename U>
+  HandlerAllocator(const HandlerAllocator<U> & other) noexcept
+      : memory_(other.memory_) {
+  }
+
+  bool operator==(const HandlerAllocator & other) const noexcept {
+    return &memory_ == &other.memory_;
+  }
+
+  bool operator!=(const HandlerAllocator & other) const noexcept {
+    return &memory_ != &other.memory_;
+  }
+
+  T * allocate(size_t n) const {
+    return static_cast<T *>(memory_.allocate(sizeof(T) * n));
+  }
+
+  void deallocate(T * pointer, size_t) const {
+    return memory_.deallocate(pointer);
+  }
+
+ private:
+  template<typename> friend class HandlerAllocator;
+
+  HandlerMemory & memory_;
+};
+
+// Wraps a completion handler so asio allocates its operation state from
+// a HandlerMemory block instead of the heap.
+template<typename Handler>
+class CustomAllocHandler {
+ public:
+  typedef HandlerAllocator<Handler> allocator_type;
+
+  CustomAllocHandler(HandlerMemory & memory, Handler handler)
+      : memory_(memory), handler_(std::move(handler)) {
+  }
+
+  allocator_type get_allocator() const noexcept {
+    return allocator_type(memory_);
+  }
+
+  template<typename... Args>
+  void operator()(Args &&... args) {
+    handler_(std::forward<Args>(args)...);
+  }
+
+ private:
+  HandlerMemory & memory_;
+  Handler handler_;
+};
+
+template<typename Handler>
+inline CustomAllocHandler<Handler> MakeCustomAllocHandler(
+    HandlerMemory & memory, Handler handler) {
+  return CustomAllocHandler<Handler>(memory, std::move(handler));
+}
+
+}  // namespace foscam_hd
+
+#endif  // HANDLER_ALLOCATOR_H_
@@ -0,0 +1,131 @@
+#include "hls_segmenter.h"
+
+#include <algorithm>
+#include <cctype>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+// Segments listed in the playlist, about 6 GOPs
+const size_t PLAYLIST_SEGMENTS = 6;
+// Kept a little longer than listed, for clients holding an older playlist
+const size_t RETAINED_SEGMENTS = PLAYLIST_SEGMENTS + 3;
+
+std::string MakeId() {
+  auto now = std::chrono::system_clock::now().time_since_epoch();
+  return std::to_string(
+      std::chrono::duration_cast<std::chrono::milliseconds>(now).count());
+}
+
+std::string SegmentName(const std::string & id, uint64_t sequence) {
+  return "segment_" + id + "_" + std::to_string(sequence) + ".m4s";
+}
+
+}  // namespace
+
+namespace foscam_hd {
+
+HlsSegmenter::HlsSegmenter(WorkerPool & worker_pool,
+                           std::shared_ptr<RemuxSession> session)
+    : session_(session),
+      id_(MakeId()),
+      init_segment_name_("init_" + id_ + ".mp4"),
+      fragment_reader_(session_->fragments(),
+                       BroadcastRing::Start::LAST_KEYFRAME),
+      next_sequence_(0),
+      // Rounded segment durations may not exceed it
+      target_duration_(RemuxSession::MAX_FRAGMENT_DURATION.count()),
+      segment_task_(worker_pool, [this]() { SegmentReady(); }) {
+  fragment_reader_.set_notifier(&segment_task_.notifier());
+  segment_task_.Schedule();
+}
+
+HlsSegmenter::~HlsSegmenter() {
+  segment_task_.Stop();
+  fragment_reader_.set_notifier(nullptr);
+}
+
+auto HlsSegmenter::WaitPlaylist(std::chrono::milliseconds timeout)
+    -> PlaylistPtr {
+  std::unique_lock<std::mutex> lock(mutex_);
+  playlist_available_.wait_for(lock, timeout, [this]() {
+    return playlist_ != nullptr;
+  });
+  return playlist_;
+}
+
+RemuxSession::InitSegmentPtr HlsSegmenter::init_segment() {
+  // Published before the first fragment, so before any playlist
+  return session_->WaitInitSegment(std::chrono::milliseconds(0));
+}
+
+MediaPacketPtr HlsSegmenter::segment(uint64_t sequence) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (segments_.empty() || sequence < segments_.front().sequence ||
+      sequence > segments_.back().sequence) {
+    return MediaPacketPtr();
+  }
+  return segments_[sequence - segments_.front().sequence].fragment;
+}
+
+bool HlsSegmenter::ParseSegmentName(const std::string & name,
+                                    uint64_t & sequence) const {
+  const std::string prefix = "segment_" + id_ + "_";
+  const std::string suffix = ".m4s";
+  if (name.size() <= prefix.size() + suffix.size() ||
+      name.compare(0, prefix.size(), prefix) != 0 ||
+      name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+    return false;
+  }
+
+  auto digits = name.substr(prefix.size(),
+                            name.size() - prefix.size() - suffix.size());
+  if (digits.size() > 19 ||
+      !std::all_of(digits.begin(), digits.end(),
+                   [](char c) { return std::isdigit(c); })) {
+    return false;
+  }
+  sequence = std::stoull(digits);
+  return true;
+}
+
+const std::string & HlsSegmenter::init_segment_name() const {
+  return init_segment_name_;
+}
+
+void HlsSegmenter::SegmentReady() {
+  MediaPacketPtr fragment;
+  while ((fragment = fragment_reader_.try_read_packet())) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    segments_.push_back(Segment{next_sequence_++, fragment});
+    if (segments_.size() > RETAINED_SEGMENTS) {
+      segments_.pop_front();
+    }
+    WritePlaylistLocked();
+  }
+}
+
+void HlsSegmenter::WritePlaylistLocked() {
+  size_t first = segments_.size() > PLAYLIST_SEGMENTS ?
+      segments_.size() - PLAYLIST_SEGMENTS : 0;
+
+  std::ostringstream playlist;
+  playlist << "#EXTM3U\n"
+           << "#EXT-X-VERSION:7\n"
+           << "#EXT-X-TARGETDURATION:" << target_duration_ << "\n"
+           << "#EXT-X-MEDIA-SEQUENCE:" << segments_[first].sequence << "\n"
+           << "#EXT-X-MAP:URI=\"" << init_segment_name_ << "\"\n"
+           << std::fixed << std::setprecision(3);
+  for (size_t idx = first; idx < segments_.size(); idx++) {
+    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(
+        segments_[idx].fragment->duration).count();
+    playlist << "#EXTINF:" << duration / 1000000.0 << ",\n"
+             << SegmentName(id_, segments_[idx].sequence) << "\n";
+  }
+
+  playlist_ = std::make_shared<const std::string>(playlist.str());
+  playlist_available_.notify_all();
+}
+
+}  // namespace foscam_hd
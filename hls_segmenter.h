@@ -0,0 +1,77 @@
+#ifndef HLS_SEGMENTER_H_
+#define HLS_SEGMENTER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "broadcast_ring.h"
+#include "media_packet.h"
+#include "remux_session.h"
+#include "worker_pool.h"
+
+namespace foscam_hd {
+
+// HTTP Live Streaming output of a GOP remux session. Each fragment the
+// session publishes becomes one fMP4 media segment, and the playlist lists a
+// rolling window of them. A segment never changes once published, so any
+// number of clients, or a caching proxy in front of them, share the same
+// buffers.
+//
+// Names are prefixed with an id unique to the segmenter, so a restarted
+// segmenter never reuses the name of a segment a cache may still hold.
+class HlsSegmenter {
+ public:
+  typedef std::shared_ptr<const std::string> PlaylistPtr;
+
+  HlsSegmenter(WorkerPool & worker_pool,
+               std::shared_ptr<RemuxSession> session);
+  ~HlsSegmenter();
+
+  // Returns the playlist, or null if no segment is available before timeout
+  PlaylistPtr WaitPlaylist(std::chrono::milliseconds timeout);
+  RemuxSession::InitSegmentPtr init_segment();
+  // Null once the segment has left the window
+  MediaPacketPtr segment(uint64_t sequence) const;
+
+  // Parses a segment name from the playlist, returns false for any other
+  // name
+  bool ParseSegmentName(const std::string & name, uint64_t & sequence) const;
+  const std::string & init_segment_name() const;
+
+ private:
+  struct Segment {
+    uint64_t sequence;
+    MediaPacketPtr fragment;
+  };
+
+  void SegmentReady();
+  void WritePlaylistLocked();
+
+  std::shared_ptr<RemuxSession> session_;
+  const std::string id_;
+  const std::string init_segment_name_;
+  BroadcastRing::Reader fragment_reader_;
+
+  mutable std::mutex mutex_;
+  std::condition_variable playlist_available_;
+  std::deque<Segment> segments_;
+  uint64_t next_sequence_;
+  // Fixed, the target duration must not change between reloads
+  const unsigned int target_duration_;
+  PlaylistPtr playlist_;
+
+  // Last so the task is stopped before anything it uses goes away
+  WorkerPool::Task segment_task_;
+
+  HlsSegmenter(const HlsSegmenter &) = delete;
+  HlsSegmenter & operator=(const HlsSegmenter &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // HLS_SEGMENTER_H_
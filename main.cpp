@@ -1,37 +1,26 @@
 #include <iostream>
-#include <thread>
+#include <memory>
 
-#include "foscam.h"
+#include "camera_manager.h"
 #include "web_app.h"
+#include "worker_pool.h"
 
 int main(int argc, char * argv[]) {
-  boost::asio::io_service io_service;
-  std::shared_ptr<foscam_hd::Foscam> cam;
+  std::string config_path = argc > 1 ? argv[1] : "cameras.ini";
+
+  foscam_hd::WorkerPool worker_pool;
+  std::unique_ptr<foscam_hd::CameraManager> cameras;
   try {
-    cam = std::make_shared<foscam_hd::Foscam>(
-        "192.168.1.8", 88, time(NULL), "hugcam", "password", io_service);
-    cam->Connect();
+    cameras.reset(new foscam_hd::CameraManager(
+        foscam_hd::LoadCameraConfigs(config_path), worker_pool));
   } catch (std::exception & ex) {
-    std::cerr << "Failed to connect to camera: " << ex.what() << std::endl;
+    std::cerr << "Failed to start cameras: " << ex.what() << std::endl;
+    return EXIT_FAILURE;
   }
 
-  // Start asio thread
-  std::thread io_thread(
-      [&io_service]() {
-        try {
-          io_service.run();
-        }
-        catch (std::exception & ex) {
-          std::cerr << "Failure occured while running service thread: "
-                    << ex.what() << std::endl;
-        }
-      });
-
   try {
-    foscam_hd::WebApp App(cam);
+    foscam_hd::WebApp App(*cameras);
     getchar();
-    cam->Disconnect();
-    io_thread.join();
   } catch (std::exception & ex) {
     std::cerr << "Failure occured while running web application: " << ex.what()
               << std::endl;
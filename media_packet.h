@@ -0,0 +1,79 @@
+#ifndef MEDIA_PACKET_H_
+#define MEDIA_PACKET_H_
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <boost/intrusive_ptr.hpp>
+
+namespace foscam_hd {
+
+// Allocator leaving elements default-initialized, so resizing a packet
+// buffer does not zero bytes that are about to be overwritten.
+template<typename T, typename A = std::allocator<T> >
+class DefaultInitAllocator : public A {
+  typedef std::allocator_traits<A> Traits;
+
+ public:
+  template<typename U>
+  struct rebind {
+    typedef DefaultInitAllocator<U, typename Traits::template rebind_alloc<U> >
+        other;
+  };
+
+  using A::A;
+
+  template<typename U>
+  void construct(U * ptr) {
+    ::new(static_cast<void *>(ptr)) U;
+  }
+
+  template<typename U, typename... Args>
+  void construct(U * ptr, Args &&... args) {
+    Traits::construct(static_cast<A &>(*this), ptr,
+                      std::forward<Args>(args)...);
+  }
+};
+
+class PacketPool;
+
+// Packets are reference counted intrusively so pooled packets can be handed
+// out and recycled without touching the heap.
+class MediaPacket {
+ public:
+  typedef std::vector<uint8_t, DefaultInitAllocator<uint8_t> > Data;
+
+  MediaPacket();
+
+  Data data;
+  std::chrono::steady_clock::time_point timestamp;
+  // Set when decoding can start at this packet
+  bool keyframe = false;
+  // Media time covered by the packet, zero when unknown
+  std::chrono::steady_clock::duration duration{};
+
+ private:
+  friend class PacketPool;
+  friend void intrusive_ptr_add_ref(const MediaPacket * packet);
+  friend void intrusive_ptr_release(const MediaPacket * packet);
+
+  mutable std::atomic<unsigned int> ref_count_;
+  std::shared_ptr<PacketPool> pool_;
+  size_t size_class_;
+
+  MediaPacket(const MediaPacket &) = delete;
+  MediaPacket & operator=(const MediaPacket &) = delete;
+};
+
+void intrusive_ptr_add_ref(const MediaPacket * packet);
+void intrusive_ptr_release(const MediaPacket * packet);
+
+typedef boost::intrusive_ptr<const MediaPacket> MediaPacketPtr;
+typedef boost::intrusive_ptr<MediaPacket> MutableMediaPacketPtr;
+
+}  // namespace foscam_hd
+
+#endif  // MEDIA_PACKET_H_
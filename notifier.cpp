@@ -0,0 +1,44 @@
+#include "notifier.h"
+
+namespace foscam_hd {
+
+Notifier::Notifier(std::function<void()> on_notify)
+    : generation_(0), cancelled_(false), on_notify_(std::move(on_notify)) {
+}
+
+void Notifier::Notify() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  generation_++;
+  lock.unlock();
+  cond_.notify_all();
+  if (on_notify_) {
+    on_notify_();
+  }
+}
+
+void Notifier::Cancel() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cancelled_ = true;
+  generation_++;
+  lock.unlock();
+  cond_.notify_all();
+}
+
+uint64_t Notifier::generation() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return generation_;
+}
+
+bool Notifier::cancelled() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return cancelled_;
+}
+
+void Notifier::Wait(uint64_t generation, std::chrono::milliseconds timeout) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  cond_.wait_for(lock, timeout, [this, generation]() {
+    return generation_ != generation || cancelled_;
+  });
+}
+
+}  // namespace foscam_hd
@@ -0,0 +1,41 @@
+#ifndef NOTIFIER_H_
+#define NOTIFIER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+namespace foscam_hd {
+
+// Readiness signal shared by producers and a waiting consumer. Consumers
+// sample the generation, check their inputs, then wait for the generation
+// to move on, so a notification between the check and the wait is not lost.
+// A consumer that is scheduled rather than waiting passes on_notify instead.
+class Notifier {
+ public:
+  explicit Notifier(std::function<void()> on_notify = nullptr);
+
+  void Notify();
+  // Wakes waiters for good, used to stop the consumer
+  void Cancel();
+
+  uint64_t generation() const;
+  bool cancelled() const;
+  void Wait(uint64_t generation, std::chrono::milliseconds timeout);
+
+ private:
+  uint64_t generation_;
+  bool cancelled_;
+  mutable std::mutex mutex_;
+  std::condition_variable cond_;
+  std::function<void()> on_notify_;
+
+  Notifier(const Notifier &) = delete;
+  Notifier & operator=(const Notifier &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // NOTIFIER_H_
@@ -0,0 +1,109 @@
+#include "packet_pool.h"
+
+namespace {
+
+// Audio packets, small video frames, P frames, I frames at main stream
+// bitrates. Anything larger is allocated on demand.
+const size_t SIZE_CLASSES[] = {
+  1024, 4 * 1024, 16 * 1024, 64 * 1024, 256 * 1024, 1024 * 1024
+};
+
+// Free packets kept per class, about 16 MiB for the large classes
+const size_t MAX_FREE_PACKETS[] = {
+  512, 512, 512, 256, 64, 16
+};
+
+const size_t UNPOOLED = static_cast<size_t>(-1);
+
+}  // namespace
+
+namespace foscam_hd {
+
+MediaPacket::MediaPacket()
+    : ref_count_(0), size_class_(UNPOOLED) {
+}
+
+void intrusive_ptr_add_ref(const MediaPacket * packet) {
+  packet->ref_count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+void intrusive_ptr_release(const MediaPacket * packet) {
+  if (packet->ref_count_.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+    return;
+  }
+
+  auto mutable_packet = const_cast<MediaPacket *>(packet);
+  if (mutable_packet->pool_) {
+    auto pool = std::move(mutable_packet->pool_);
+    pool->Recycle(mutable_packet);
+  } else {
+    delete mutable_packet;
+  }
+}
+
+PacketPool::PacketPool() {
+  static_assert(sizeof(SIZE_CLASSES) / sizeof(SIZE_CLASSES[0]) ==
+                SIZE_CLASS_COUNT, "Size class count mismatch");
+
+  for (size_t size_class = 0; size_class < SIZE_CLASS_COUNT; size_class++) {
+    free_packets_[size_class].reserve(MAX_FREE_PACKETS[size_class]);
+  }
+}
+
+PacketPool::~PacketPool() {
+  for (auto & free_packets : free_packets_) {
+    for (auto packet : free_packets) {
+      delete packet;
+    }
+  }
+}
+
+MutableMediaPacketPtr PacketPool::Acquire(size_t size) {
+  size_t size_class = 0;
+  while (size_class < SIZE_CLASS_COUNT && SIZE_CLASSES[size_class] < size) {
+    size_class++;
+  }
+
+  MediaPacket * packet = nullptr;
+  if (size_class < SIZE_CLASS_COUNT) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto & free_packets = free_packets_[size_class];
+    if (!free_packets.empty()) {
+      packet = free_packets.back();
+      free_packets.pop_back();
+    }
+  }
+
+  if (!packet) {
+    packet = new MediaPacket();
+    if (size_class < SIZE_CLASS_COUNT) {
+      packet->data.reserve(SIZE_CLASSES[size_class]);
+      packet->size_class_ = size_class;
+    }
+  }
+
+  if (packet->size_class_ != UNPOOLED) {
+    packet->pool_ = shared_from_this();
+  }
+  packet->data.resize(size);
+  packet->keyframe = false;
+  packet->duration = std::chrono::steady_clock::duration::zero();
+
+  return MutableMediaPacketPtr(packet);
+}
+
+void PacketPool::Recycle(MediaPacket * packet) {
+  packet->data.clear();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto & free_packets = free_packets_[packet->size_class_];
+  if (free_packets.size() < MAX_FREE_PACKETS[packet->size_class_]) {
+    free_packets.push_back(packet);
+    return;
+  }
+  lock.unlock();
+
+  delete packet;
+}
+
+}  // namespace foscam_hd
@@ -0,0 +1,40 @@
+#ifndef PACKET_POOL_H_
+#define PACKET_POOL_H_
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "media_packet.h"
+
+namespace foscam_hd {
+
+// Size-classed pool of receive packets. A packet returns to its class when
+// its last reference is dropped, on whichever thread that happens; packets
+// still in flight keep the pool alive.
+class PacketPool : public std::enable_shared_from_this<PacketPool> {
+ public:
+  PacketPool();
+  ~PacketPool();
+
+  // Packet with data resized to size, contents left uninitialized
+  MutableMediaPacketPtr Acquire(size_t size);
+
+ private:
+  friend void intrusive_ptr_release(const MediaPacket * packet);
+
+  static const size_t SIZE_CLASS_COUNT = 6;
+
+  void Recycle(MediaPacket * packet);
+
+  std::mutex mutex_;
+  std::array<std::vector<MediaPacket *>, SIZE_CLASS_COUNT> free_packets_;
+
+  PacketPool(const PacketPool &) = delete;
+  PacketPool & operator=(const PacketPool &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // PACKET_POOL_H_
@@ -0,0 +1,220 @@
+#include "pcm_resampler.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define PCM_RESAMPLER_X86
+#endif
+
+namespace {
+
+// A multiple of the taps per block in every kernel, 8 for SSE2, 16 for AVX2
+const unsigned int KERNEL_TAPS = 32;
+
+const unsigned int COEFFICIENT_BITS = 14;
+
+// Passband edge as a fraction of the input rate, below its Nyquist frequency
+// to leave room for the transition band
+const double CUTOFF = 0.45;
+
+inline int16_t Round(int32_t accumulator) {
+  accumulator = (accumulator + (1 << (COEFFICIENT_BITS - 1))) >>
+      COEFFICIENT_BITS;
+  return std::min(std::max(accumulator, -32768), 32767);
+}
+
+size_t ResampleScalar(const int16_t * window, size_t count,
+                      const int16_t * coefficients, unsigned int up,
+                      unsigned int down, size_t & index, unsigned int & phase,
+                      int16_t * output) {
+  int16_t * out = output;
+  while (index < count) {
+    const int16_t * samples = window + index;
+    const int16_t * phase_coefficients = coefficients + phase * KERNEL_TAPS;
+    int32_t accumulator = 0;
+    for (unsigned int tap = 0; tap < KERNEL_TAPS; tap++) {
+      accumulator += samples[tap] * phase_coefficients[tap];
+    }
+    *out++ = Round(accumulator);
+
+    phase += down;
+    while (phase >= up) {
+      phase -= up;
+      index++;
+    }
+  }
+  return out - output;
+}
+
+#ifdef PCM_RESAMPLER_X86
+
+#ifdef __SSE2__
+size_t ResampleSse2(const int16_t * window, size_t count,
+                    const int16_t * coefficients, unsigned int up,
+                    unsigned int down, size_t & index, unsigned int & phase,
+                    int16_t * output) {
+  int16_t * out = output;
+  while (index < count) {
+    auto samples = reinterpret_cast<const __m128i *>(window + index);
+    auto phase_coefficients = reinterpret_cast<const __m128i *>(
+        coefficients + phase * KERNEL_TAPS);
+    __m128i sum = _mm_setzero_si128();
+    for (unsigned int block = 0; block < KERNEL_TAPS / 8; block++) {
+      sum = _mm_add_epi32(sum, _mm_madd_epi16(
+          _mm_loadu_si128(samples + block),
+          _mm_loadu_si128(phase_coefficients + block)));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    *out++ = Round(_mm_cvtsi128_si32(sum));
+
+    phase += down;
+    while (phase >= up) {
+      phase -= up;
+      index++;
+    }
+  }
+  return out - output;
+}
+#endif  // __SSE2__
+
+__attribute__((target("avx2")))
+size_t ResampleAvx2(const int16_t * window, size_t count,
+                    const int16_t * coefficients, unsigned int up,
+                    unsigned int down, size_t & index, unsigned int & phase,
+                    int16_t * output) {
+  int16_t * out = output;
+  while (index < count) {
+    auto samples = reinterpret_cast<const __m256i *>(window + index);
+    auto phase_coefficients = reinterpret_cast<const __m256i *>(
+        coefficients + phase * KERNEL_TAPS);
+    __m256i products = _mm256_setzero_si256();
+    for (unsigned int block = 0; block < KERNEL_TAPS / 16; block++) {
+      products = _mm256_add_epi32(products, _mm256_madd_epi16(
+          _mm256_loadu_si256(samples + block),
+          _mm256_loadu_si256(phase_coefficients + block)));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(products),
+                                _mm256_extracti128_si256(products, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    *out++ = Round(_mm_cvtsi128_si32(sum));
+
+    phase += down;
+    while (phase >= up) {
+      phase -= up;
+      index++;
+    }
+  }
+  return out - output;
+}
+
+#endif  // PCM_RESAMPLER_X86
+
+typedef size_t (*ResampleFunc)(const int16_t *, size_t, const int16_t *,
+                               unsigned int, unsigned int, size_t &,
+                               unsigned int &, int16_t *);
+
+ResampleFunc SelectResample() {
+#ifdef PCM_RESAMPLER_X86
+  if (__builtin_cpu_supports("avx2")) {
+    return ResampleAvx2;
+  }
+#ifdef __SSE2__
+  return ResampleSse2;
+#endif
+#endif
+  return ResampleScalar;
+}
+
+const ResampleFunc resample = SelectResample();
+
+// Blackman windowed sinc at the upsampled rate, split into its phases. Each
+// phase is normalized to unity gain so no phase adds a DC ripple.
+std::vector<int16_t> MakeCoefficients(unsigned int up, unsigned int taps) {
+  const double length = static_cast<double>(up) * taps;
+  const double center = (length - 1) / 2;
+  const double cutoff = CUTOFF / up;
+
+  std::vector<int16_t> coefficients(up * taps);
+  std::vector<double> phase_coefficients(taps);
+  for (unsigned int phase = 0; phase < up; phase++) {
+    double sum = 0;
+    for (unsigned int tap = 0; tap < taps; tap++) {
+      // Stored in input order: the last tap applies to the newest sample
+      double position = (taps - 1 - tap) * static_cast<double>(up) + phase;
+      double x = position - center;
+      double sinc = x == 0 ? 1.0 :
+          std::sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+      double window = 0.42 - 0.5 * std::cos(2 * M_PI * position / length) +
+          0.08 * std::cos(4 * M_PI * position / length);
+      phase_coefficients[tap] = sinc * window;
+      sum += phase_coefficients[tap];
+    }
+
+    int16_t * out = coefficients.data() + phase * taps;
+    int total = 0;
+    unsigned int largest = 0;
+    for (unsigned int tap = 0; tap < taps; tap++) {
+      out[tap] = std::lround(phase_coefficients[tap] / sum *
+                             (1 << COEFFICIENT_BITS));
+      total += out[tap];
+      if (std::abs(out[tap]) > std::abs(out[largest])) {
+        largest = tap;
+      }
+    }
+    out[largest] += (1 << COEFFICIENT_BITS) - total;
+  }
+
+  return coefficients;
+}
+
+}  // namespace
+
+namespace foscam_hd {
+
+// std::min binds it by reference
+template <unsigned int InputRate, unsigned int OutputRate>
+const size_t PcmResampler<InputRate, OutputRate>::CHUNK_SIZE;
+
+template <unsigned int InputRate, unsigned int OutputRate>
+PcmResampler<InputRate, OutputRate>::PcmResampler()
+    : coefficients_(MakeCoefficients(UP, TAPS)),
+      window_(TAPS - 1 + CHUNK_SIZE),
+      index_(0),
+      phase_(0) {
+  static_assert(TAPS == KERNEL_TAPS, "No kernel for this filter length");
+}
+
+template <unsigned int InputRate, unsigned int OutputRate>
+size_t PcmResampler<InputRate, OutputRate>::max_output(size_t count) {
+  return (count * UP + DOWN - 1) / DOWN + 1;
+}
+
+template <unsigned int InputRate, unsigned int OutputRate>
+size_t PcmResampler<InputRate, OutputRate>::Process(const int16_t * input,
+                                                    size_t count,
+                                                    int16_t * output) {
+  int16_t * out = output;
+  while (count > 0) {
+    size_t chunk = std::min(count, CHUNK_SIZE);
+    memcpy(window_.data() + TAPS - 1, input, chunk * sizeof(int16_t));
+    out += resample(window_.data(), chunk, coefficients_.data(), UP, DOWN,
+                    index_, phase_, out);
+
+    // Keep the tail as history for the next chunk
+    index_ -= chunk;
+    memmove(window_.data(), window_.data() + chunk,
+            (TAPS - 1) * sizeof(int16_t));
+    input += chunk;
+    count -= chunk;
+  }
+  return out - output;
+}
+
+template class PcmResampler<8000, 44100>;
+
+}  // namespace foscam_hd
@@ -0,0 +1,54 @@
+#ifndef PCM_RESAMPLER_H_
+#define PCM_RESAMPLER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace foscam_hd {
+
+constexpr unsigned int PcmRateGcd(unsigned int a, unsigned int b) {
+  return b == 0 ? a : PcmRateGcd(b, a % b);
+}
+
+// Polyphase FIR resampler for mono s16 at a ratio fixed at compile time.
+// Each output sample is a TAPS long inner product with Q14 coefficients,
+// run on AVX2 or SSE2 when the CPU has them. Output lags the input by
+// TAPS / 2 input samples.
+template <unsigned int InputRate, unsigned int OutputRate>
+class PcmResampler {
+ public:
+  static const unsigned int TAPS = 32;
+  static const unsigned int UP = OutputRate / PcmRateGcd(InputRate,
+                                                          OutputRate);
+  static const unsigned int DOWN = InputRate / PcmRateGcd(InputRate,
+                                                          OutputRate);
+
+  PcmResampler();
+
+  // Upper bound of the samples produced from count input samples
+  static size_t max_output(size_t count);
+
+  // Returns the number of samples written to output
+  size_t Process(const int16_t * input, size_t count, int16_t * output);
+
+ private:
+  static const size_t CHUNK_SIZE = 1024;
+
+  // TAPS coefficients per phase, in input order
+  std::vector<int16_t> coefficients_;
+  // The last TAPS - 1 input samples followed by the chunk being resampled
+  std::vector<int16_t> window_;
+  size_t index_;
+  unsigned int phase_;
+
+  PcmResampler(const PcmResampler &) = delete;
+  PcmResampler & operator=(const PcmResampler &) = delete;
+};
+
+// The camera's 8 kHz PCM to the MP3 encoder's rate
+typedef PcmResampler<8000, 44100> CameraPcmResampler;
+
+}  // namespace foscam_hd
+
+#endif  // PCM_RESAMPLER_H_
@@ -0,0 +1,546 @@
+#include "recorder.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+
+namespace {
+
+// O_DIRECT needs buffers, offsets and sizes aligned to the logical block
+// size, 4 KiB covers the usual disks
+const size_t ALIGNMENT = 4096;
+const size_t BLOCK_SIZE = 1024 * 1024;
+// Room for a few GOPs while the disk is busy
+const size_t BLOCK_COUNT = 8;
+
+const char INDEX_NAME[] = "index.bin";
+
+// Segments started within a second of each other, or of one left by an
+// earlier run, move on to the next free second
+const int MAX_NAME_ATTEMPTS = 60;
+
+// Bounds the pre-roll when fragment durations are unknown, a minute of the
+// main stream at its highest bit rate
+const size_t MAX_PRE_ROLL_BYTES = 64 * 1024 * 1024;
+
+std::string RecordingName(int64_t start_time) {
+  time_t seconds = start_time;
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+  char name[32];
+  strftime(name, sizeof(name), "recording_%Y%m%dT%H%M%SZ.mp4", &utc);
+  return name;
+}
+
+// Accepts exactly the names RecordingName makes
+bool ParseRecordingName(const std::string & name, int64_t & start_time) {
+  struct tm utc = {};
+  int length = 0;
+  if (sscanf(name.c_str(), "recording_%4d%2d%2dT%2d%2d%2dZ.mp4%n",
+             &utc.tm_year, &utc.tm_mon, &utc.tm_mday, &utc.tm_hour,
+             &utc.tm_min, &utc.tm_sec, &length) != 6 ||
+      static_cast<size_t>(length) != name.size()) {
+    return false;
+  }
+  utc.tm_year -= 1900;
+  utc.tm_mon -= 1;
+  start_time = timegm(&utc);
+  return RecordingName(start_time) == name;
+}
+
+std::chrono::system_clock::time_point WallTime(
+    std::chrono::steady_clock::time_point time) {
+  auto age = std::chrono::steady_clock::now() - time;
+  return std::chrono::system_clock::now() -
+      std::chrono::duration_cast<std::chrono::system_clock::duration>(age);
+}
+
+std::string BaseName(const std::string & path) {
+  auto slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// Fails with EEXIST rather than overwrite a recording
+int CreateFile(const std::string & path, bool & direct) {
+  direct = true;
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_DIRECT, 0644);
+  if (fd < 0 && errno == EINVAL) {
+    // Filesystems such as tmpfs refuse O_DIRECT
+    direct = false;
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  }
+  return fd;
+}
+
+}  // namespace
+
+namespace foscam_hd {
+
+RecorderException::RecorderException(const std::string & what)
+    : what_("RecorderException: " + what) {
+}
+
+const char* RecorderException::what() const noexcept {
+  return what_.c_str();
+}
+
+Recorder::Recorder(WorkerPool & worker_pool,
+                   std::shared_ptr<RemuxSession> session,
+                   const RecorderConfig & config)
+    : session_(session),
+      config_(config),
+      fragment_reader_(session_->fragments(),
+                       BroadcastRing::Start::LAST_KEYFRAME),
+      recording_(false),
+      segment_time_(0),
+      segment_offset_(0),
+      segment_elapsed_(0),
+      current_block_(nullptr),
+      pre_roll_duration_(0),
+      pre_roll_bytes_(0),
+      stopping_(false),
+      fd_(-1),
+      direct_(false),
+      file_size_(0),
+      file_start_time_(0),
+      write_failed_(false),
+      recordings_size_(0),
+      record_task_(worker_pool, [this]() { FragmentReady(); }) {
+  if (mkdir(config_.directory.c_str(), 0755) != 0 && errno != EEXIST) {
+    throw RecorderException("Failed to create " + config_.directory + ": " +
+                            strerror(errno));
+  }
+  index_.reset(new RecordingIndex(config_.directory + "/" + INDEX_NAME));
+  ScanRecordings();
+
+  blocks_.resize(BLOCK_COUNT);
+  for (auto & block : blocks_) {
+    void * data;
+    if (posix_memalign(&data, ALIGNMENT, BLOCK_SIZE) != 0) {
+      throw RecorderException("Failed to allocate write buffers");
+    }
+    block.data = static_cast<uint8_t *>(data);
+    block.size = 0;
+    free_blocks_.push_back(&block);
+  }
+
+  writer_thread_ = std::thread(&Recorder::WriterRun, this);
+
+  fragment_reader_.set_notifier(&record_task_.notifier());
+  record_task_.Schedule();
+}
+
+Recorder::~Recorder() {
+  record_task_.Stop();
+  fragment_reader_.set_notifier(nullptr);
+  if (recording_) {
+    EndSegment();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  writes_available_.notify_one();
+  writer_thread_.join();
+
+  for (auto & block : blocks_) {
+    free(block.data);
+  }
+}
+
+auto Recorder::stats() const -> Stats {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+bool Recorder::Seek(std::chrono::system_clock::time_point time,
+                    Position & position) const {
+  RecordingIndex::Entry entry;
+  RecordingIndex::Entry segment_start;
+  if (!index_->Find(std::chrono::duration_cast<std::chrono::milliseconds>(
+                        time.time_since_epoch()).count(),
+                    entry, segment_start)) {
+    return false;
+  }
+
+  position.name = RecordingName(entry.segment_time);
+  position.init_size = segment_start.offset;
+  position.offset = entry.offset;
+  position.time = std::chrono::system_clock::time_point(
+      std::chrono::milliseconds(entry.time));
+  return true;
+}
+
+int Recorder::OpenRecording(const std::string & name) const {
+  int64_t start_time;
+  if (!ParseRecordingName(name, start_time)) {
+    return -1;
+  }
+  return open((config_.directory + "/" + name).c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+void Recorder::TriggerEvent() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    event_end_ = std::max(event_end_,
+                          std::chrono::steady_clock::now() + config_.post_roll);
+    stats_.events++;
+  }
+  // Writes the pre-roll without waiting for the next fragment
+  record_task_.Schedule();
+}
+
+void Recorder::FragmentReady() {
+  if (config_.event_triggered &&
+      EventActive(std::chrono::steady_clock::now())) {
+    FlushPreRoll();
+  }
+
+  MediaPacketPtr fragment;
+  while ((fragment = fragment_reader_.try_read_packet())) {
+    if (config_.event_triggered) {
+      if (!EventActive(fragment->timestamp)) {
+        if (recording_) {
+          EndSegment();
+        }
+        KeepPreRoll(fragment);
+        continue;
+      }
+      FlushPreRoll();
+    }
+    RecordFragment(fragment);
+  }
+}
+
+bool Recorder::EventActive(std::chrono::steady_clock::time_point time) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return time < event_end_;
+}
+
+void Recorder::KeepPreRoll(const MediaPacketPtr & fragment) {
+  pre_roll_.push_back(fragment);
+  pre_roll_duration_ += fragment->duration;
+  pre_roll_bytes_ += fragment->data.size();
+  // Whole fragments, as long as the rest still covers the pre-roll
+  while (!pre_roll_.empty() &&
+         (pre_roll_duration_ - pre_roll_.front()->duration >=
+              config_.pre_roll ||
+          pre_roll_bytes_ > MAX_PRE_ROLL_BYTES)) {
+    pre_roll_duration_ -= pre_roll_.front()->duration;
+    pre_roll_bytes_ -= pre_roll_.front()->data.size();
+    pre_roll_.pop_front();
+  }
+}
+
+void Recorder::FlushPreRoll() {
+  for (auto & fragment : pre_roll_) {
+    RecordFragment(fragment);
+  }
+  pre_roll_.clear();
+  pre_roll_duration_ = std::chrono::steady_clock::duration::zero();
+  pre_roll_bytes_ = 0;
+}
+
+void Recorder::RecordFragment(const MediaPacketPtr & fragment) {
+  // Segments start on a keyframe so each file plays on its own
+  if (recording_ && fragment->keyframe &&
+      segment_elapsed_ >= config_.segment_duration) {
+    EndSegment();
+  }
+  if (!recording_) {
+    if (!fragment->keyframe) {
+      return;
+    }
+    StartSegment(fragment);
+    if (!recording_) {
+      return;
+    }
+  }
+
+  uint64_t offset = segment_offset_;
+  if (!Append(fragment->data.data(), fragment->data.size())) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.dropped_fragments++;
+    return;
+  }
+  segment_elapsed_ += fragment->duration;
+
+  if (fragment->keyframe) {
+    RecordingIndex::Entry entry;
+    entry.time = std::chrono::duration_cast<std::chrono::milliseconds>(
+        WallTime(fragment->timestamp).time_since_epoch()).count();
+    entry.segment_time = segment_time_;
+    entry.offset = offset;
+    Submit(DiskWrite{std::string(), nullptr, false, true, entry,
+                     segment_offset_});
+  }
+}
+
+void Recorder::StartSegment(const MediaPacketPtr & fragment) {
+  // Published before the first fragment
+  auto init_segment = session_->WaitInitSegment(std::chrono::milliseconds(0));
+  if (!init_segment) {
+    return;
+  }
+
+  // Named after the first fragment, which comes from the pre-roll for events
+  segment_time_ = std::chrono::system_clock::to_time_t(
+      WallTime(fragment->timestamp));
+  Submit(DiskWrite{config_.directory + "/" + RecordingName(segment_time_),
+                   nullptr, false});
+  recording_ = true;
+  segment_offset_ = 0;
+  segment_elapsed_ = std::chrono::steady_clock::duration::zero();
+  if (!Append(init_segment->data(), init_segment->size())) {
+    // Nothing was written, the empty file is removed
+    EndSegment();
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.dropped_fragments++;
+  }
+}
+
+void Recorder::EndSegment() {
+  Submit(DiskWrite{std::string(), current_block_, true});
+  current_block_ = nullptr;
+  recording_ = false;
+}
+
+bool Recorder::Append(const uint8_t * data, size_t size) {
+  // All or nothing, a partial fragment would corrupt the file
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size_t room = free_blocks_.size() * BLOCK_SIZE;
+    if (current_block_) {
+      room += BLOCK_SIZE - current_block_->size;
+    }
+    if (room < size) {
+      return false;
+    }
+  }
+
+  while (size > 0) {
+    if (!current_block_) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      current_block_ = free_blocks_.back();
+      free_blocks_.pop_back();
+      current_block_->size = 0;
+    }
+
+    size_t chunk = std::min(size, BLOCK_SIZE - current_block_->size);
+    memcpy(current_block_->data + current_block_->size, data, chunk);
+    current_block_->size += chunk;
+    segment_offset_ += chunk;
+    data += chunk;
+    size -= chunk;
+
+    if (current_block_->size == BLOCK_SIZE) {
+      Submit(DiskWrite{std::string(), current_block_, false});
+      current_block_ = nullptr;
+    }
+  }
+  return true;
+}
+
+void Recorder::Submit(DiskWrite write) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    writes_.push_back(std::move(write));
+  }
+  writes_available_.notify_one();
+}
+
+void Recorder::WriterRun() {
+  while (true) {
+    DiskWrite write;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      writes_available_.wait(lock, [this]() {
+        return !writes_.empty() || stopping_;
+      });
+      if (writes_.empty()) {
+        break;
+      }
+      write = std::move(writes_.front());
+      writes_.pop_front();
+    }
+
+    if (!write.open_path.empty()) {
+      if (fd_ >= 0) {
+        CloseFile();
+      }
+      ParseRecordingName(BaseName(write.open_path), file_start_time_);
+      file_size_ = 0;
+      write_failed_ = false;
+      for (int attempt = 1; ; attempt++) {
+        path_ = config_.directory + "/" + RecordingName(file_start_time_);
+        fd_ = CreateFile(path_, direct_);
+        if (fd_ >= 0 || errno != EEXIST || attempt == MAX_NAME_ATTEMPTS) {
+          break;
+        }
+        file_start_time_++;
+      }
+      if (fd_ < 0) {
+        std::cerr << "Failed to open " << path_ << ": " << strerror(errno)
+                  << std::endl;
+      }
+    }
+
+    if (write.block) {
+      WriteBlock(*write.block);
+      std::lock_guard<std::mutex> lock(mutex_);
+      free_blocks_.push_back(write.block);
+    }
+
+    if (write.indexed) {
+      pending_entries_.push_back(PendingEntry{write.index_entry,
+                                              write.index_end});
+    }
+    FlushIndex();
+
+    if (write.close) {
+      CloseFile();
+    }
+  }
+
+  if (fd_ >= 0) {
+    CloseFile();
+  }
+}
+
+void Recorder::WriteBlock(const Block & block) {
+  if (fd_ < 0 || write_failed_) {
+    return;
+  }
+
+  // Only the last block of a file is partial. It is padded to the alignment
+  // and the file truncated back when closed.
+  size_t size = block.size;
+  if (direct_ && size % ALIGNMENT) {
+    size_t padded = (size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    memset(block.data + size, 0, padded - size);
+    size = padded;
+  }
+
+  size_t written = 0;
+  while (written < size) {
+    ssize_t ret = pwrite(fd_, block.data + written, size - written,
+                         file_size_ + written);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      std::cerr << "Failed to write " << path_ << ": " << strerror(errno)
+                << std::endl;
+      write_failed_ = true;
+      return;
+    }
+    written += ret;
+  }
+  file_size_ += block.size;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  stats_.bytes_written += block.size;
+}
+
+void Recorder::FlushIndex() {
+  // A seek must never land on a fragment still partly in memory
+  while (!pending_entries_.empty() &&
+         pending_entries_.front().end <= file_size_) {
+    auto & entry = pending_entries_.front().entry;
+    // The segment may have been renamed when its file was created
+    entry.segment_time = file_start_time_;
+    try {
+      index_->Append(entry);
+    } catch (RecordingIndexException & ex) {
+      std::cerr << ex.what() << std::endl;
+    }
+    pending_entries_.pop_front();
+  }
+}
+
+void Recorder::CloseFile() {
+  // Entries past what made it to disk are dropped with the file's tail
+  pending_entries_.clear();
+  if (fd_ < 0) {
+    return;
+  }
+  if (direct_ && ftruncate(fd_, file_size_) != 0) {
+    std::cerr << "Failed to truncate " << path_ << ": " << strerror(errno)
+              << std::endl;
+  }
+  close(fd_);
+  fd_ = -1;
+
+  if (file_size_ == 0) {
+    unlink(path_.c_str());
+    return;
+  }
+  recordings_.push_back(Recording{path_, file_size_, file_start_time_});
+  recordings_size_ += file_size_;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.segments++;
+  }
+  EnforceQuota();
+}
+
+void Recorder::EnforceQuota() {
+  // The segment just written is always kept
+  while (config_.max_bytes && recordings_size_ > config_.max_bytes &&
+         recordings_.size() > 1) {
+    auto & oldest = recordings_.front();
+    if (unlink(oldest.path.c_str()) != 0 && errno != ENOENT) {
+      std::cerr << "Failed to delete " << oldest.path << ": "
+                << strerror(errno) << std::endl;
+    }
+    index_->Expire(oldest.start_time);
+    recordings_size_ -= oldest.size;
+    recordings_.pop_front();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    stats_.deleted_segments++;
+  }
+}
+
+void Recorder::ScanRecordings() {
+  // Segments left by earlier runs count towards the quota; their names sort
+  // by start time
+  DIR * dir = opendir(config_.directory.c_str());
+  if (!dir) {
+    throw RecorderException("Failed to open " + config_.directory + ": " +
+                            strerror(errno));
+  }
+
+  std::vector<std::string> names;
+  int64_t start_time;
+  while (struct dirent * entry = readdir(dir)) {
+    if (ParseRecordingName(entry->d_name, start_time)) {
+      names.push_back(entry->d_name);
+    }
+  }
+  closedir(dir);
+  std::sort(names.begin(), names.end());
+
+  for (auto & name : names) {
+    std::string path = config_.directory + "/" + name;
+    struct stat status;
+    if (stat(path.c_str(), &status) == 0) {
+      ParseRecordingName(name, start_time);
+      recordings_.push_back(Recording{path, static_cast<uint64_t>(
+          status.st_size), start_time});
+      recordings_size_ += status.st_size;
+    }
+  }
+}
+
+}  // namespace foscam_hd
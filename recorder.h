@@ -0,0 +1,191 @@
+#ifndef RECORDER_H_
+#define RECORDER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "broadcast_ring.h"
+#include "recording_index.h"
+#include "remux_session.h"
+#include "worker_pool.h"
+
+namespace foscam_hd {
+
+class RecorderException : public std::exception {
+ public:
+  explicit RecorderException(const std::string & what);
+
+  const char* what() const noexcept override;
+
+ private:
+  std::string what_;
+};
+
+struct RecorderConfig {
+  std::string directory;
+  // Segments are cut at the first keyframe past this duration
+  std::chrono::seconds segment_duration{60};
+  // Oldest segments are deleted to stay under this, zero keeps everything
+  uint64_t max_bytes = 0;
+
+  // Only records around events, see Recorder::TriggerEvent
+  bool event_triggered = false;
+  // Kept in memory and written ahead of each event
+  std::chrono::seconds pre_roll{10};
+  // Recorded after the last event
+  std::chrono::seconds post_roll{30};
+};
+
+// Continuous recording of a GOP remux session to disk. Each segment is a
+// standalone fragmented mp4 file: the init segment followed by the session's
+// fragments, named after its UTC start time.
+//
+// Fragments are copied into large aligned blocks on the worker pool and
+// written by a thread of the recorder's own with O_DIRECT, so a slow disk
+// never blocks the pipeline. If every block is waiting on the disk, whole
+// fragments are dropped until one is free again.
+//
+// Keyframe fragments are indexed by wall-clock time once they are on disk,
+// see RecordingIndex.
+//
+// In event triggered mode nothing is written until an event. Meanwhile the
+// last pre_roll worth of fragments is held by reference, whole GOPs, so the
+// clip starts before the event that triggered it.
+class Recorder {
+ public:
+  struct Stats {
+    uint64_t segments = 0;
+    uint64_t bytes_written = 0;
+    uint64_t dropped_fragments = 0;
+    uint64_t deleted_segments = 0;
+    uint64_t events = 0;
+  };
+
+  // Where playback of a given time starts in the recordings
+  struct Position {
+    // Segment file name, for OpenRecording
+    std::string name;
+    // The segment's init segment is its first init_size bytes
+    uint64_t init_size;
+    // Keyframe fragment at or before the requested time
+    uint64_t offset;
+    std::chrono::system_clock::time_point time;
+  };
+
+  Recorder(WorkerPool & worker_pool, std::shared_ptr<RemuxSession> session,
+           const RecorderConfig & config);
+  ~Recorder();
+
+  Stats stats() const;
+
+  // Records from the pre-roll up to post_roll past now, extending the
+  // recording in progress if any
+  void TriggerEvent();
+
+  bool Seek(std::chrono::system_clock::time_point time,
+            Position & position) const;
+  // Opens a segment file for reading, returns -1 if name is not one
+  int OpenRecording(const std::string & name) const;
+
+ private:
+  struct Block {
+    uint8_t * data;
+    size_t size;
+  };
+
+  // Disk work handed to the writer thread, in order
+  struct DiskWrite {
+    // Starts a new file before the block is written
+    std::string open_path;
+    Block * block;
+    // Closes the file after the block
+    bool close;
+    // Indexed once the whole fragment it points to is on disk
+    bool indexed;
+    RecordingIndex::Entry index_entry;
+    uint64_t index_end;
+  };
+
+  struct PendingEntry {
+    RecordingIndex::Entry entry;
+    // End of the fragment in the segment file
+    uint64_t end;
+  };
+
+  struct Recording {
+    std::string path;
+    uint64_t size;
+    int64_t start_time;
+  };
+
+  void FragmentReady();
+  bool EventActive(std::chrono::steady_clock::time_point time) const;
+  void KeepPreRoll(const MediaPacketPtr & fragment);
+  void FlushPreRoll();
+  void RecordFragment(const MediaPacketPtr & fragment);
+  void StartSegment(const MediaPacketPtr & fragment);
+  void EndSegment();
+  bool Append(const uint8_t * data, size_t size);
+  void Submit(DiskWrite write);
+
+  void WriterRun();
+  void WriteBlock(const Block & block);
+  void FlushIndex();
+  void CloseFile();
+  void EnforceQuota();
+  void ScanRecordings();
+
+  std::shared_ptr<RemuxSession> session_;
+  const RecorderConfig config_;
+  std::unique_ptr<RecordingIndex> index_;
+  BroadcastRing::Reader fragment_reader_;
+
+  // Only touched by the record task
+  bool recording_;
+  int64_t segment_time_;
+  uint64_t segment_offset_;
+  std::chrono::steady_clock::duration segment_elapsed_;
+  Block * current_block_;
+  std::deque<MediaPacketPtr> pre_roll_;
+  std::chrono::steady_clock::duration pre_roll_duration_;
+  size_t pre_roll_bytes_;
+
+  // Aligned blocks, free ones are listed in free_blocks_
+  std::vector<Block> blocks_;
+  std::vector<Block *> free_blocks_;
+  std::deque<DiskWrite> writes_;
+  bool stopping_;
+  std::chrono::steady_clock::time_point event_end_;
+  Stats stats_;
+  mutable std::mutex mutex_;
+  std::condition_variable writes_available_;
+
+  // Only touched by the writer thread
+  int fd_;
+  bool direct_;
+  std::string path_;
+  uint64_t file_size_;
+  int64_t file_start_time_;
+  bool write_failed_;
+  std::deque<PendingEntry> pending_entries_;
+  std::deque<Recording> recordings_;
+  uint64_t recordings_size_;
+
+  std::thread writer_thread_;
+  // Last so the task is stopped before anything it uses goes away
+  WorkerPool::Task record_task_;
+
+  Recorder(const Recorder &) = delete;
+  Recorder & operator=(const Recorder &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // RECORDER_H_
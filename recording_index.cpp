@@ -0,0 +1,198 @@
+#include "recording_index.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+const uint32_t INDEX_MAGIC = 0x46434958;  // "FCIX"
+const uint32_t INDEX_VERSION = 1;
+
+// A day of one second GOPs, doubled as needed
+const size_t INITIAL_CAPACITY = 64 * 1024;
+
+// Dead entries are only reclaimed once they are this many and the majority
+const size_t COMPACT_MIN_ENTRIES = 4096;
+
+}  // namespace
+
+namespace foscam_hd {
+
+RecordingIndexException::RecordingIndexException(const std::string & what)
+    : what_("RecordingIndexException: " + what) {
+}
+
+const char* RecordingIndexException::what() const noexcept {
+  return what_.c_str();
+}
+
+RecordingIndex::RecordingIndex(const std::string & path)
+    : path_(path), fd_(-1), data_(nullptr), capacity_(0) {
+  static_assert(sizeof(Header) == 24 && sizeof(Entry) == 24,
+                "Index layout must not depend on the compiler");
+
+  fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd_ < 0) {
+    throw RecordingIndexException("Failed to open " + path_ + ": " +
+                                  strerror(errno));
+  }
+
+  struct stat status;
+  if (fstat(fd_, &status) != 0) {
+    close(fd_);
+    throw RecordingIndexException("Failed to stat " + path_ + ": " +
+                                  strerror(errno));
+  }
+
+  try {
+    size_t file_size = status.st_size;
+    if (file_size < sizeof(Header) + sizeof(Entry)) {
+      Initialize();
+      return;
+    }
+
+    Map((file_size - sizeof(Header)) / sizeof(Entry));
+    Header & index_header = header();
+    if (index_header.magic != INDEX_MAGIC ||
+        index_header.version != INDEX_VERSION ||
+        index_header.count > capacity_) {
+      std::cerr << "Discarding invalid recording index " << path_
+                << std::endl;
+      Initialize();
+      return;
+    }
+    // Left behind by a compaction that was interrupted
+    if (index_header.first > index_header.count) {
+      index_header.first = 0;
+    }
+  } catch (...) {
+    if (data_) {
+      munmap(data_, sizeof(Header) + capacity_ * sizeof(Entry));
+    }
+    close(fd_);
+    throw;
+  }
+}
+
+RecordingIndex::~RecordingIndex() {
+  munmap(data_, sizeof(Header) + capacity_ * sizeof(Entry));
+  close(fd_);
+}
+
+size_t RecordingIndex::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return header().count - header().first;
+}
+
+void RecordingIndex::Append(Entry entry) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Growing may move the mapping
+  if (header().count == capacity_) {
+    Map(capacity_ * 2);
+  }
+
+  Header & index_header = header();
+  Entry * index_entries = entries();
+  if (index_header.count > 0) {
+    entry.time = std::max(entry.time,
+                          index_entries[index_header.count - 1].time);
+  }
+  // The count goes up only once the entry is complete
+  index_entries[index_header.count] = entry;
+  index_header.count++;
+}
+
+void RecordingIndex::Expire(int64_t segment_time) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  Header & index_header = header();
+  Entry * index_entries = entries();
+  while (index_header.first < index_header.count &&
+         index_entries[index_header.first].segment_time <= segment_time) {
+    index_header.first++;
+  }
+
+  // The live entries are fewer than the dead ones, so they are copied below
+  // first without overlapping the original. The count is lowered before the
+  // first entry is reset; a first past the count is reset when reopened.
+  size_t live = index_header.count - index_header.first;
+  if (index_header.first >= COMPACT_MIN_ENTRIES && live < index_header.first) {
+    memcpy(index_entries, index_entries + index_header.first,
+           live * sizeof(Entry));
+    index_header.count = live;
+    index_header.first = 0;
+  }
+}
+
+bool RecordingIndex::Find(int64_t time, Entry & entry,
+                          Entry & segment_start) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const Header & index_header = header();
+  const Entry * begin = entries() + index_header.first;
+  const Entry * end = entries() + index_header.count;
+  if (begin == end) {
+    return false;
+  }
+
+  auto found = std::upper_bound(begin, end, time,
+                                [](int64_t time, const Entry & entry) {
+                                  return time < entry.time;
+                                });
+  if (found != begin) {
+    found--;
+  }
+  entry = *found;
+
+  // A segment only holds a minute or so of entries
+  while (found != begin && (found - 1)->segment_time == entry.segment_time) {
+    found--;
+  }
+  segment_start = *found;
+  return true;
+}
+
+void RecordingIndex::Initialize() {
+  // Zero filled, whatever the file held before
+  if (ftruncate(fd_, 0) != 0 ||
+      ftruncate(fd_, sizeof(Header) + INITIAL_CAPACITY * sizeof(Entry)) != 0) {
+    throw RecordingIndexException("Failed to truncate " + path_ + ": " +
+                                  strerror(errno));
+  }
+  Map(INITIAL_CAPACITY);
+  header() = Header{INDEX_MAGIC, INDEX_VERSION, 0, 0};
+}
+
+void RecordingIndex::Map(size_t capacity) {
+  size_t old_size = sizeof(Header) + capacity_ * sizeof(Entry);
+  size_t size = sizeof(Header) + capacity * sizeof(Entry);
+  if (capacity > capacity_ && ftruncate(fd_, size) != 0) {
+    throw RecordingIndexException("Failed to grow " + path_ + ": " +
+                                  strerror(errno));
+  }
+
+  void * data = data_ ?
+      mremap(data_, old_size, size, MREMAP_MAYMOVE) :
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+  if (data == MAP_FAILED) {
+    throw RecordingIndexException("Failed to map " + path_ + ": " +
+                                  strerror(errno));
+  }
+  data_ = static_cast<uint8_t *>(data);
+  capacity_ = capacity;
+}
+
+auto RecordingIndex::header() const -> Header & {
+  return *reinterpret_cast<Header *>(data_);
+}
+
+auto RecordingIndex::entries() const -> Entry * {
+  return reinterpret_cast<Entry *>(data_ + sizeof(Header));
+}
+
+}  // namespace foscam_hd
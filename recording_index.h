@@ -0,0 +1,77 @@
+#ifndef RECORDING_INDEX_H_
+#define RECORDING_INDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace foscam_hd {
+
+class RecordingIndexException : public std::exception {
+ public:
+  explicit RecordingIndexException(const std::string & what);
+
+  const char* what() const noexcept override;
+
+ private:
+  std::string what_;
+};
+
+// Append-only index of the keyframe fragments in the recordings, kept in a
+// memory-mapped file: a small header followed by fixed-size entries sorted
+// by time, so a seek is a binary search however much footage there is.
+//
+// Entries of deleted segments are skipped by moving the header's first live
+// entry forward; the live entries are moved down once most are dead.
+class RecordingIndex {
+ public:
+  struct Entry {
+    // Wall-clock time of the fragment, in ms since the epoch
+    int64_t time;
+    // Start time of the segment file holding it, in s since the epoch
+    int64_t segment_time;
+    // Byte offset of the fragment in the segment file
+    uint64_t offset;
+  };
+
+  explicit RecordingIndex(const std::string & path);
+  ~RecordingIndex();
+
+  size_t size() const;
+
+  // Times going backwards are clamped so the entries stay sorted
+  void Append(Entry entry);
+  // Drops the entries of the segments started at or before segment_time
+  void Expire(int64_t segment_time);
+  // Finds the last entry at or before time, or the first one if time is
+  // older than the index, and the first entry of its segment
+  bool Find(int64_t time, Entry & entry, Entry & segment_start) const;
+
+ private:
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint64_t first;
+  };
+
+  void Initialize();
+  void Map(size_t capacity);
+  Header & header() const;
+  Entry * entries() const;
+
+  const std::string path_;
+  int fd_;
+  uint8_t * data_;
+  // Entries the file has room for
+  size_t capacity_;
+  mutable std::mutex mutex_;
+
+  RecordingIndex(const RecordingIndex &) = delete;
+  RecordingIndex & operator=(const RecordingIndex &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // RECORDING_INDEX_H_
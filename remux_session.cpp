@@ -0,0 +1,329 @@
+#include "remux_session.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+// Fragments are cut on keyframes, so this is about 16 GOPs
+const size_t FRAGMENT_RING_CAPACITY = 16;
+// One fragment per frame, a few GOPs as well
+const size_t FRAME_FRAGMENT_RING_CAPACITY = 512;
+
+// Framerate assumed when the camera's is unknown
+const unsigned int DEFAULT_FRAMERATE = 30;
+
+// Packets muxed before the task yields its worker
+const size_t PACKETS_PER_RUN = 32;
+
+// Audio waiting for the video to catch up, about 6 seconds of MP3 frames
+const size_t MAX_PENDING_AUDIO = 256;
+
+// A GOP longer than this, about 10 seconds, is cut without a keyframe
+const size_t MAX_PENDING_FRAMES = 300;
+
+// Audio timestamps further than this from the running decode time restart it
+const std::chrono::milliseconds AUDIO_RESYNC_THRESHOLD(100);
+
+}  // namespace
+
+namespace foscam_hd {
+
+const std::chrono::seconds RemuxSession::MAX_FRAGMENT_DURATION(10);
+
+RemuxSession::RemuxSession(WorkerPool & worker_pool,
+                           BroadcastRing & video_ring,
+                           std::shared_ptr<AudioTranscoder> audio, Mode mode,
+                           const BufferLimits & input_limits,
+                           const std::vector<uint8_t> & parameter_sets,
+                           unsigned int framerate)
+    : audio_(audio),
+      mode_(mode),
+      video_reader_(video_ring, BroadcastRing::Start::LAST_KEYFRAME),
+      audio_reader_(audio ? new BroadcastRing::Reader(audio->packets())
+                          : nullptr),
+      fragment_ring_(mode == Mode::LOW_LATENCY ? FRAME_FRAGMENT_RING_CAPACITY :
+                                                 FRAGMENT_RING_CAPACITY),
+      parameter_sets_(parameter_sets),
+      next_decode_time_(0),
+      frame_duration_(Fmp4Writer::VIDEO_TIMESCALE /
+                      (framerate != 0 ? framerate : DEFAULT_FRAMERATE)),
+      audio_started_(false),
+      next_audio_decode_time_(0),
+      fragment_pool_(std::make_shared<PacketPool>()),
+      total_delay_(0),
+      mux_task_(worker_pool, [this]() { MuxReady(); }) {
+  video_reader_.set_limits(input_limits);
+  video_reader_.set_notifier(&mux_task_.notifier());
+  if (audio_reader_) {
+    audio_reader_->set_limits(input_limits);
+    audio_reader_->set_notifier(&mux_task_.notifier());
+  }
+  // The GOP already in the ring is muxed right away
+  mux_task_.Schedule();
+}
+
+RemuxSession::~RemuxSession() {
+  mux_task_.Stop();
+  video_reader_.set_notifier(nullptr);
+  if (audio_reader_) {
+    audio_reader_->set_notifier(nullptr);
+  }
+}
+
+auto RemuxSession::WaitInitSegment(std::chrono::milliseconds timeout)
+    -> InitSegmentPtr {
+  std::unique_lock<std::mutex> lock(init_segment_mutex_);
+  init_segment_available_.wait_for(lock, timeout, [this]() {
+    return init_segment_ != nullptr;
+  });
+  return init_segment_;
+}
+
+BroadcastRing & RemuxSession::fragments() {
+  return fragment_ring_;
+}
+
+DropStats RemuxSession::video_input_drop_stats() const {
+  return video_reader_.drop_stats();
+}
+
+DropStats RemuxSession::audio_input_drop_stats() const {
+  return audio_ ? audio_->input_drop_stats() : DropStats();
+}
+
+auto RemuxSession::interleave_stats() const -> InterleaveStats {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  return interleave_stats_;
+}
+
+void RemuxSession::PublishInitSegment(std::vector<uint8_t> init_segment) {
+  std::lock_guard<std::mutex> lock(init_segment_mutex_);
+  init_segment_ = std::make_shared<const std::vector<uint8_t> >(
+      std::move(init_segment));
+  init_segment_available_.notify_all();
+}
+
+void RemuxSession::MuxReady() {
+  for (size_t count = 0; count < PACKETS_PER_RUN; count++) {
+    if (!next_video_) {
+      next_video_ = video_reader_.try_read_packet();
+    }
+    if (audio_reader_ && !next_audio_) {
+      next_audio_ = audio_reader_->try_read_packet();
+    }
+
+    // Earliest timestamp first, so a burst on one input does not hold back
+    // the other. Nothing waits for an input that has no packet yet; late
+    // audio goes into the next fragment.
+    if (next_audio_ && (!next_video_ ||
+                        next_audio_->timestamp <= next_video_->timestamp)) {
+      QueueAudioPacket(next_audio_);
+      next_audio_.reset();
+    } else if (next_video_) {
+      MuxAccessUnit(next_video_);
+      next_video_.reset();
+    } else {
+      return;
+    }
+    UpdateQueueDepth();
+  }
+
+  // More may be queued, let other tasks run first
+  mux_task_.Schedule();
+}
+
+void RemuxSession::MuxAccessUnit(const MediaPacketPtr & packet) {
+  if (!writer_) {
+    // Start at the first keyframe whose parameter sets are known
+    std::vector<uint8_t> parameter_sets;
+    if (ExtractParameterSets(packet->data.data(), packet->data.size(),
+                             parameter_sets)) {
+      parameter_sets_.swap(parameter_sets);
+    }
+    if (!packet->keyframe || parameter_sets_.empty()) {
+      return;
+    }
+
+    try {
+      if (audio_) {
+        Fmp4Writer::AudioConfig audio_config;
+        audio_config.sample_rate = audio_->config().sample_rate;
+        audio_config.channels = audio_->config().channels;
+        audio_config.bit_rate = audio_->config().bit_rate;
+        writer_.reset(new Fmp4Writer(parameter_sets_, &audio_config));
+      } else {
+        writer_.reset(new Fmp4Writer(parameter_sets_));
+      }
+    } catch (Fmp4WriterException & ex) {
+      std::cerr << ex.what() << std::endl;
+      return;
+    }
+    PublishInitSegment(writer_->init_segment());
+    start_time_ = packet->timestamp;
+    fragment_start_time_ = start_time_;
+  }
+
+  if (mode_ == Mode::LOW_LATENCY) {
+    WriteFrameFragment(packet);
+    return;
+  }
+
+  // Fragments span a GOP, cut when the next keyframe arrives. A long GOP or
+  // a stall is cut at MAX_FRAGMENT_DURATION, the rest of it goes in the next
+  // fragment.
+  auto fragment_end = fragment_start_time_ + MAX_FRAGMENT_DURATION;
+  if (!gop_.empty() &&
+      (packet->keyframe || gop_.size() >= MAX_PENDING_FRAMES ||
+       packet->timestamp >= fragment_end)) {
+    WriteFragment(std::min(packet->timestamp, fragment_end));
+  }
+  if (gop_.empty()) {
+    fragment_read_time_ = std::chrono::steady_clock::now();
+  }
+  gop_.push_back(Fmp4Writer::Sample{packet, 0});
+}
+
+void RemuxSession::QueueAudioPacket(const MediaPacketPtr & packet) {
+  if (pending_audio_.size() >= MAX_PENDING_AUDIO) {
+    pending_audio_.pop_front();
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    interleave_stats_.dropped_packets++;
+  }
+  pending_audio_.push_back(
+      PendingAudio{packet, std::chrono::steady_clock::now()});
+}
+
+void RemuxSession::UpdateQueueDepth() {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  interleave_stats_.queue_depth = gop_.size() + pending_audio_.size();
+  interleave_stats_.max_queue_depth = std::max(
+      interleave_stats_.max_queue_depth, interleave_stats_.queue_depth);
+}
+
+void RemuxSession::WriteFragment(std::chrono::steady_clock::time_point end) {
+  // Durations follow the arrival times, rounded against the session start so
+  // they do not drift
+  uint64_t decode_time = next_decode_time_;
+  for (size_t idx = 0; idx < gop_.size(); idx++) {
+    auto next = idx + 1 < gop_.size() ? gop_[idx + 1].packet->timestamp : end;
+    uint64_t next_decode_time = std::max(
+        decode_time + 1, DecodeTime(next, Fmp4Writer::VIDEO_TIMESCALE));
+    gop_[idx].duration = next_decode_time - decode_time;
+    decode_time = next_decode_time;
+  }
+
+  CollectAudioSamples(end);
+  PushFragment(next_decode_time_);
+  next_decode_time_ = decode_time;
+  fragment_start_time_ = end;
+}
+
+void RemuxSession::WriteFrameFragment(const MediaPacketPtr & packet) {
+  uint64_t arrival = DecodeTime(packet->timestamp, Fmp4Writer::VIDEO_TIMESCALE);
+  if (next_decode_time_ != 0) {
+    uint64_t last_arrival = DecodeTime(last_frame_time_,
+                                       Fmp4Writer::VIDEO_TIMESCALE);
+    uint64_t interval = arrival > last_arrival ? arrival - last_arrival : 0;
+    frame_duration_ = std::max<uint64_t>(1, (frame_duration_ * 7 + interval) /
+                                            8);
+  }
+  last_frame_time_ = packet->timestamp;
+
+  // A frame that arrives early starts where the previous estimate ended, a
+  // late one leaves a gap
+  uint64_t decode_time = std::max(next_decode_time_, arrival);
+  fragment_read_time_ = std::chrono::steady_clock::now();
+  gop_.push_back(Fmp4Writer::Sample{packet, frame_duration_});
+  CollectAudioSamples(packet->timestamp);
+  PushFragment(decode_time);
+  next_decode_time_ = decode_time + frame_duration_;
+}
+
+void RemuxSession::PushFragment(uint64_t decode_time) {
+  size_t size = writer_->PrepareFragment(
+      gop_.data(), gop_.size(), decode_time, audio_samples_.data(),
+      audio_samples_.size(), next_audio_decode_time_);
+  auto fragment = fragment_pool_->Acquire(size);
+  uint8_t * out = fragment->data.data();
+  for (auto & piece : writer_->pieces()) {
+    memcpy(out, piece.iov_base, piece.iov_len);
+    out += piece.iov_len;
+  }
+  fragment->timestamp = gop_.front().packet->timestamp;
+  fragment->keyframe = gop_.front().packet->keyframe;
+  uint64_t duration = 0;
+  for (auto & sample : gop_) {
+    duration += sample.duration;
+  }
+  fragment->duration = std::chrono::microseconds(
+      duration * 1000000 / Fmp4Writer::VIDEO_TIMESCALE);
+  fragment_ring_.push(fragment);
+
+  {
+    auto delay = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - fragment_read_time_);
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    interleave_stats_.fragments++;
+    total_delay_ += delay;
+    interleave_stats_.mean_delay = total_delay_ / interleave_stats_.fragments;
+    interleave_stats_.max_delay = std::max(interleave_stats_.max_delay, delay);
+  }
+
+  for (auto & sample : audio_samples_) {
+    next_audio_decode_time_ += sample.duration;
+  }
+  gop_.clear();
+  audio_samples_.clear();
+}
+
+void RemuxSession::CollectAudioSamples(
+    std::chrono::steady_clock::time_point end) {
+  if (!audio_) {
+    return;
+  }
+
+  // MP3 frames are contiguous, the running decode time only follows the
+  // timestamps when the input had a gap or drifted
+  uint32_t sample_rate = audio_->config().sample_rate;
+  uint32_t frame_size = audio_->config().frame_size;
+  while (!pending_audio_.empty() &&
+         pending_audio_.front().packet->timestamp < end) {
+    MediaPacketPtr packet = pending_audio_.front().packet;
+    fragment_read_time_ = std::min(fragment_read_time_,
+                                   pending_audio_.front().read_time);
+    pending_audio_.pop_front();
+    if (packet->timestamp < start_time_) {
+      continue;
+    }
+
+    uint64_t decode_time = DecodeTime(packet->timestamp, sample_rate);
+    uint64_t threshold = sample_rate * AUDIO_RESYNC_THRESHOLD.count() / 1000;
+    // Audio that ran ahead, as the camera clock is fast, is dropped until
+    // the timestamps catch up
+    if (audio_started_ &&
+        decode_time + threshold < next_audio_decode_time_ +
+                                  audio_samples_.size() * frame_size) {
+      continue;
+    }
+
+    if (audio_samples_.empty()) {
+      if (!audio_started_ || decode_time > next_audio_decode_time_ +
+                                           threshold) {
+        next_audio_decode_time_ = decode_time;
+        audio_started_ = true;
+      }
+    }
+    audio_samples_.push_back(Fmp4Writer::Sample{packet, frame_size});
+  }
+}
+
+uint64_t RemuxSession::DecodeTime(std::chrono::steady_clock::time_point time,
+                                  uint32_t timescale) const {
+  auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      time - start_time_).count();
+  return elapsed * timescale / 1000000;
+}
+
+}  // namespace foscam_hd
@@ -0,0 +1,139 @@
+#ifndef REMUX_SESSION_H_
+#define REMUX_SESSION_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "audio_transcoder.h"
+#include "broadcast_ring.h"
+#include "buffer_limits.h"
+#include "fmp4_writer.h"
+#include "packet_pool.h"
+#include "worker_pool.h"
+
+namespace foscam_hd {
+
+// Remux pipeline shared by every viewer of a camera. The camera packets are
+// turned into fragmented mp4 once; the init segment (ftyp+moov) is cached
+// and each moof+mdat fragment is published to a ring that viewers read.
+//
+// The session starts from the last keyframe already in the video ring, with
+// the camera's cached parameter sets fed first, so the first fragment does
+// not wait for a new GOP.
+//
+// Audio comes already encoded from the camera's AudioTranscoder; its MP3
+// frames go into the fragments next to the video they arrived with.
+class RemuxSession {
+ public:
+  typedef std::shared_ptr<const std::vector<uint8_t> > InitSegmentPtr;
+
+  // GOP fragments are cut at this duration even without a keyframe
+  static const std::chrono::seconds MAX_FRAGMENT_DURATION;
+
+  // GOP fragments are cut on keyframes. LOW_LATENCY writes each access unit
+  // as its own fragment as soon as it arrives, so only keyframe fragments
+  // are keyframes in the ring.
+  enum class Mode {
+    GOP,
+    LOW_LATENCY
+  };
+
+  // Packets read from the inputs and waiting to be written in a fragment
+  struct InterleaveStats {
+    size_t queue_depth = 0;
+    size_t max_queue_depth = 0;
+    uint64_t dropped_packets = 0;
+    // Longest wait of a packet in each fragment, from being read to being
+    // written
+    uint64_t fragments = 0;
+    std::chrono::microseconds mean_delay{0};
+    std::chrono::microseconds max_delay{0};
+  };
+
+  // audio may be null for a video-only session. framerate, 0 if unknown,
+  // gives the frame duration assumed until two frames have arrived.
+  RemuxSession(WorkerPool & worker_pool, BroadcastRing & video_ring,
+               std::shared_ptr<AudioTranscoder> audio, Mode mode,
+               const BufferLimits & input_limits,
+               const std::vector<uint8_t> & parameter_sets,
+               unsigned int framerate);
+  ~RemuxSession();
+
+  // Returns the init segment, or null if it is not available before timeout
+  InitSegmentPtr WaitInitSegment(std::chrono::milliseconds timeout);
+  BroadcastRing & fragments();
+
+  DropStats video_input_drop_stats() const;
+  DropStats audio_input_drop_stats() const;
+  InterleaveStats interleave_stats() const;
+
+ private:
+  struct PendingAudio {
+    MediaPacketPtr packet;
+    std::chrono::steady_clock::time_point read_time;
+  };
+
+  void PublishInitSegment(std::vector<uint8_t> init_segment);
+
+  void MuxReady();
+  void MuxAccessUnit(const MediaPacketPtr & packet);
+  void QueueAudioPacket(const MediaPacketPtr & packet);
+  void UpdateQueueDepth();
+  void WriteFragment(std::chrono::steady_clock::time_point end);
+  void WriteFrameFragment(const MediaPacketPtr & packet);
+  void PushFragment(uint64_t decode_time);
+  void CollectAudioSamples(std::chrono::steady_clock::time_point end);
+  uint64_t DecodeTime(std::chrono::steady_clock::time_point time,
+                      uint32_t timescale) const;
+
+  std::shared_ptr<AudioTranscoder> audio_;
+  const Mode mode_;
+  BroadcastRing::Reader video_reader_;
+  std::unique_ptr<BroadcastRing::Reader> audio_reader_;
+  BroadcastRing fragment_ring_;
+
+  // Only touched by the mux task
+  std::vector<uint8_t> parameter_sets_;
+  std::unique_ptr<Fmp4Writer> writer_;
+  std::vector<Fmp4Writer::Sample> gop_;
+  std::chrono::steady_clock::time_point start_time_;
+  uint64_t next_decode_time_;
+  // Where the fragment being built starts, the end of the previous one
+  std::chrono::steady_clock::time_point fragment_start_time_;
+  // Low latency fragments go out before the next frame gives their duration,
+  // it is estimated from the recent frame interval
+  uint32_t frame_duration_;
+  std::chrono::steady_clock::time_point last_frame_time_;
+  // Next packet of each input, the earliest of the two is muxed first
+  MediaPacketPtr next_video_;
+  MediaPacketPtr next_audio_;
+  std::deque<PendingAudio> pending_audio_;
+  // Read time of the oldest packet in the fragment being built
+  std::chrono::steady_clock::time_point fragment_read_time_;
+  std::vector<Fmp4Writer::Sample> audio_samples_;
+  bool audio_started_;
+  uint64_t next_audio_decode_time_;
+  std::shared_ptr<PacketPool> fragment_pool_;
+
+  InterleaveStats interleave_stats_;
+  std::chrono::microseconds total_delay_;
+  mutable std::mutex stats_mutex_;
+
+  InitSegmentPtr init_segment_;
+  std::mutex init_segment_mutex_;
+  std::condition_variable init_segment_available_;
+
+  // Last so the mux task is stopped before anything it uses goes away
+  WorkerPool::Task mux_task_;
+
+  RemuxSession(const RemuxSession &) = delete;
+  RemuxSession & operator=(const RemuxSession &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // REMUX_SESSION_H_
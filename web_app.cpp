@@ -1,7 +1,13 @@
 #include <web_app.h>
 
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 
 #include <microhttpd.h>
 
@@ -9,6 +15,28 @@ namespace {
 
 const unsigned int PORT = 8888;
 
+const std::string CAMERA_PREFIX = "/camera/";
+const std::string CAMERAS_PATH = "/cameras";
+
+const std::string HLS_PREFIX = "/hls/";
+const std::string HLS_PLAYLIST_NAME = "playlist.m3u8";
+
+// The first segment is only out after a full GOP
+const std::chrono::milliseconds HLS_PLAYLIST_TIMEOUT(5000);
+
+// Playlists change with every segment; segment names are never reused
+const char HLS_PLAYLIST_CACHE_CONTROL[] = "no-cache";
+const char HLS_SEGMENT_CACHE_CONTROL[] = "public, max-age=86400, immutable";
+
+const std::string RECORDINGS_PREFIX = "/recordings/";
+const std::string RECORDING_SEEK_NAME = "seek";
+
+struct SharedBuffer {
+  std::shared_ptr<const void> owner;
+  const uint8_t * data;
+  size_t size;
+};
+
 void BufferFile(const std::string & file_path, std::vector<uint8_t> & buffer) {
   std::ifstream file(file_path.c_str(), std::ifstream::binary);
   file.seekg(0, file.end);
@@ -21,6 +49,54 @@ void BufferFile(const std::string & file_path, std::vector<uint8_t> & buffer) {
   }
 }
 
+// Parses a single range of a Range header into [begin, end). Returns the
+// status to answer with; anything but a single byte range is ignored and
+// the whole file served, as RFC 7233 allows.
+unsigned int ParseRange(const char * range, uint64_t size, uint64_t & begin,
+                        uint64_t & end) {
+  begin = 0;
+  end = size;
+  const char prefix[] = "bytes=";
+  if (!range || strncmp(range, prefix, sizeof(prefix) - 1) != 0 ||
+      strchr(range, ',')) {
+    return MHD_HTTP_OK;
+  }
+
+  const char * spec = range + sizeof(prefix) - 1;
+  char * rest;
+  if (*spec == '-') {
+    // The last bytes of the file
+    uint64_t length = strtoull(spec + 1, &rest, 10);
+    if (rest == spec + 1 || *rest) {
+      return MHD_HTTP_OK;
+    }
+    if (length == 0 || size == 0) {
+      return MHD_HTTP_RANGE_NOT_SATISFIABLE;
+    }
+    begin = size - std::min(length, size);
+    return MHD_HTTP_PARTIAL_CONTENT;
+  }
+
+  uint64_t first = strtoull(spec, &rest, 10);
+  if (rest == spec || *rest != '-') {
+    return MHD_HTTP_OK;
+  }
+  const char * last_spec = rest + 1;
+  uint64_t last = size;
+  if (*last_spec) {
+    last = strtoull(last_spec, &rest, 10);
+    if (rest == last_spec || *rest || last < first) {
+      return MHD_HTTP_OK;
+    }
+  }
+  if (first >= size) {
+    return MHD_HTTP_RANGE_NOT_SATISFIABLE;
+  }
+  begin = first;
+  end = std::min(last, size - 1) + 1;
+  return MHD_HTTP_PARTIAL_CONTENT;
+}
+
 }  // namespace
 
 namespace foscam_hd {
@@ -52,17 +128,55 @@ static ssize_t HandleVideoStreamCallback(void * callback_object, uint64_t positi
 }
 
 static void FreeVideoStreamCallback(void * callback_object) {
-  delete reinterpret_cast<Foscam::Stream *>(callback_object);
+  auto stream = reinterpret_cast<Foscam::Stream *>(callback_object);
+
+  auto stats = stream->GetStats();
+  if (stats.video_input.drop_events || stats.audio_input.drop_events ||
+      stats.output.drop_events) {
+    std::cerr << "Stream closed after dropping "
+              << stats.video_input.dropped_bytes << " video input bytes, "
+              << stats.audio_input.dropped_bytes << " audio input bytes and "
+              << stats.output.dropped_bytes << " output bytes" << std::endl;
+  }
+
+  if (stats.fragments) {
+    std::cerr << "Stream closed after " << stats.fragments
+              << " fragments, latency mean "
+              << stats.mean_latency.count() / 1000 << " ms, max "
+              << stats.max_latency.count() / 1000 << " ms" << std::endl;
+    std::cerr << "Remux queue depth max " << stats.interleave.max_queue_depth
+              << " packets, " << stats.interleave.dropped_packets
+              << " dropped, added delay mean "
+              << stats.interleave.mean_delay.count() / 1000 << " ms, max "
+              << stats.interleave.max_delay.count() / 1000 << " ms"
+              << std::endl;
+  }
+
+  delete stream;
 }
 
-WebApp::WebApp(std::shared_ptr<Foscam> cam)
-    : cam_(cam), http_server_(nullptr) {
+static ssize_t HandleSharedBufferCallback(void * callback_object,
+                                          uint64_t position, char * buffer,
+                                          size_t max_size) {
+  auto shared_buffer = reinterpret_cast<SharedBuffer *>(callback_object);
+  if (position >= shared_buffer->size) {
+    return MHD_CONTENT_READER_END_OF_STREAM;
+  }
+
+  size_t size = std::min<uint64_t>(shared_buffer->size - position, max_size);
+  memcpy(buffer, shared_buffer->data + position, size);
+  return size;
+}
+
+static void FreeSharedBufferCallback(void * callback_object) {
+  delete reinterpret_cast<SharedBuffer *>(callback_object);
+}
+
+WebApp::WebApp(const CameraManager & cameras)
+    : cameras_(cameras), http_server_(nullptr) {
   BufferFile("favicon.ico", favicon_);
   BufferFile("video_player.html", video_player_);
 
-  cam_->VideoOn();
-  cam_->AudioOn();
-
   http_server_ = MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION, PORT, nullptr,
                                   nullptr, HandleConnectionCallback, this,
                                   MHD_OPTION_END);
@@ -84,12 +198,61 @@ int WebApp::HandleConnection(MHD_Connection * connection, const char * url,
     return MHD_NO;
   }
 
-  if (url == std::string("/")) {
-    return HandleGetBuffer(connection, video_player_, "text/html");
-  } else if (url == std::string("/favicon.ico")) {
+  std::string path(url);
+  if (path == "/favicon.ico") {
     return HandleGetBuffer(connection, favicon_, "image/x-icon");
-  } else if (url == std::string("/video_stream")) {
-    return HandleGetVideoStream(connection);
+  } else if (path == CAMERAS_PATH) {
+    return HandleGetCameras(connection);
+  }
+
+  std::shared_ptr<Foscam> cam;
+  std::string prefix;
+  if (path.compare(0, CAMERA_PREFIX.size(), CAMERA_PREFIX) == 0) {
+    // The id is looked up in a map the manager no longer changes
+    size_t id_end = path.find('/', CAMERA_PREFIX.size());
+    if (id_end == std::string::npos) {
+      return HandleStatus(connection, MHD_HTTP_NOT_FOUND);
+    }
+    cam = cameras_.camera(path.substr(CAMERA_PREFIX.size(),
+                                      id_end - CAMERA_PREFIX.size()));
+    prefix = path.substr(0, id_end);
+    path.erase(0, id_end);
+  } else {
+    cam = cameras_.default_camera();
+  }
+  if (!cam) {
+    return HandleStatus(connection, MHD_HTTP_NOT_FOUND);
+  }
+
+  return HandleCameraRequest(connection, *cam, prefix, path);
+}
+
+int WebApp::HandleCameraRequest(struct MHD_Connection * connection,
+                                Foscam & cam, const std::string & prefix,
+                                const std::string & path) {
+  if (path == "/") {
+    // The player refers to the stream relative to its own URL
+    return HandleGetBuffer(connection, video_player_, "text/html");
+  } else if (path == "/video_stream") {
+    if (!cam.connected()) {
+      return HandleStatus(connection, MHD_HTTP_SERVICE_UNAVAILABLE);
+    }
+    // ?low_latency=1 streams one fragment per frame
+    const char * low_latency = MHD_lookup_connection_value(
+        connection, MHD_GET_ARGUMENT_KIND, "low_latency");
+    return HandleGetVideoStream(
+        connection, cam,
+        low_latency && std::string(low_latency) == "1" ?
+        RemuxSession::Mode::LOW_LATENCY : RemuxSession::Mode::GOP);
+  } else if (path.compare(0, HLS_PREFIX.size(), HLS_PREFIX) == 0) {
+    return HandleGetHls(connection, cam, path.substr(HLS_PREFIX.size()));
+  } else if (path.compare(0, RECORDINGS_PREFIX.size(),
+                          RECORDINGS_PREFIX) == 0) {
+    std::string name = path.substr(RECORDINGS_PREFIX.size());
+    if (name == RECORDING_SEEK_NAME) {
+      return HandleGetRecordingSeek(connection, cam, prefix);
+    }
+    return HandleGetRecording(connection, cam, name);
   }
 
   return MHD_NO;
@@ -109,9 +272,24 @@ int WebApp::HandleGetBuffer(struct MHD_Connection * connection,
   return ret;
 }
 
-int WebApp::HandleGetVideoStream(struct MHD_Connection * connection) {
+int WebApp::HandleGetCameras(struct MHD_Connection * connection) {
+  std::ostringstream json;
+  json << "{\"cameras\": [";
+  const char * separator = "";
+  for (auto & id : cameras_.ids()) {
+    json << separator << "\"" << id << "\"";
+    separator = ", ";
+  }
+  json << "]}\n";
+  auto body = std::make_shared<const std::string>(json.str());
+  return HandleGetSharedBuffer(
+      connection, body, reinterpret_cast<const uint8_t *>(body->data()),
+      body->size(), "application/json", "no-cache");
+}
 
-  auto stream = cam_->CreateStream();
+int WebApp::HandleGetVideoStream(struct MHD_Connection * connection,
+                                 Foscam & cam, RemuxSession::Mode mode) {
+  auto stream = cam.CreateStream(mode);
 
   MHD_Response * response = MHD_create_response_from_callback(
       MHD_SIZE_UNKNOWN, 16 * 1024, HandleVideoStreamCallback,
@@ -124,4 +302,170 @@ int WebApp::HandleGetVideoStream(struct MHD_Connection * connection) {
   return ret;
 }
 
+int WebApp::HandleGetHls(struct MHD_Connection * connection, Foscam & cam,
+                         const std::string & name) {
+  // Only the playlist starts the segmenter, the other names come from it
+  if (name == HLS_PLAYLIST_NAME) {
+    auto playlist = cam.GetHlsSegmenter()->WaitPlaylist(HLS_PLAYLIST_TIMEOUT);
+    if (!playlist) {
+      return HandleStatus(connection, MHD_HTTP_SERVICE_UNAVAILABLE);
+    }
+    return HandleGetSharedBuffer(
+        connection, playlist,
+        reinterpret_cast<const uint8_t *>(playlist->data()), playlist->size(),
+        "application/vnd.apple.mpegurl", HLS_PLAYLIST_CACHE_CONTROL);
+  }
+
+  auto segmenter = cam.hls_segmenter();
+  if (!segmenter) {
+    return HandleStatus(connection, MHD_HTTP_NOT_FOUND);
+  }
+
+  if (name == segmenter->init_segment_name()) {
+    auto init_segment = segmenter->init_segment();
+    if (!init_segment) {
+      return HandleStatus(connection, MHD_HTTP_NOT_FOUND);
+    }
+    return HandleGetSharedBuffer(connection, init_segment,
+                                 init_segment->data(), init_segment->size(),
+                                 "video/mp4", HLS_SEGMENT_CACHE_CONTROL);
+  }
+
+  uint64_t sequence;
+  if (!segmenter->ParseSegmentName(name, sequence)) {
+    return HandleStatus(connection, MHD_HTTP_NOT_FOUND);
+  }
+  auto segment = segmenter->segment(sequence);
+  if (!segment) {
+    return HandleStatus(connection, MHD_HTTP_NOT_FOUND);
+  }
+  // The packet's own reference count keeps it alive for the response
+  std::shared_ptr<const void> owner(segment.get(),
+                                    [segment](const void *) {});
+  return HandleGetSharedBuffer(connection, owner, segment->data.data(),
+                               segment->data.size(), "video/mp4",
+                               HLS_SEGMENT_CACHE_CONTROL);
+}
+
+int WebApp::HandleGetRecordingSeek(struct MHD_Connection * connection,
+                                   Foscam & cam, const std::string & prefix) {
+  // ?time= is in ms since the epoch. The answer locates the keyframe at or
+  // before it; a player fetches the init segment and then the fragments from
+  // the offset on with Range requests.
+  auto recorder = cam.recorder();
+  if (!recorder) {
+    return HandleStatus(connection, MHD_HTTP_NOT_FOUND);
+  }
+
+  const char * time = MHD_lookup_connection_value(
+      connection, MHD_GET_ARGUMENT_KIND, "time");
+  char * rest;
+  long long milliseconds = time ? strtoll(time, &rest, 10) : 0;
+  if (!time || rest == time || *rest) {
+    return HandleStatus(connection, MHD_HTTP_BAD_REQUEST);
+  }
+
+  Recorder::Position position;
+  if (!recorder->Seek(std::chrono::system_clock::time_point(
+                          std::chrono::milliseconds(milliseconds)),
+                      position)) {
+    return HandleStatus(connection, MHD_HTTP_NOT_FOUND);
+  }
+
+  std::ostringstream json;
+  json << "{\"url\": \"" << prefix << RECORDINGS_PREFIX << position.name
+       << "\", \"init_size\": " << position.init_size
+       << ", \"offset\": " << position.offset
+       << ", \"time\": "
+       << std::chrono::duration_cast<std::chrono::milliseconds>(
+              position.time.time_since_epoch()).count()
+       << "}\n";
+  auto body = std::make_shared<const std::string>(json.str());
+  return HandleGetSharedBuffer(
+      connection, body, reinterpret_cast<const uint8_t *>(body->data()),
+      body->size(), "application/json", "no-cache");
+}
+
+int WebApp::HandleGetRecording(struct MHD_Connection * connection,
+                               Foscam & cam, const std::string & name) {
+  auto recorder = cam.recorder();
+  int fd = recorder ? recorder->OpenRecording(name) : -1;
+  struct stat status;
+  if (fd < 0 || fstat(fd, &status) != 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return HandleStatus(connection, MHD_HTTP_NOT_FOUND);
+  }
+
+  // The segment being recorded is served up to what is on disk so far
+  uint64_t size = status.st_size;
+  uint64_t begin;
+  uint64_t end;
+  unsigned int http_status = ParseRange(
+      MHD_lookup_connection_value(connection, MHD_HEADER_KIND,
+                                  MHD_HTTP_HEADER_RANGE),
+      size, begin, end);
+  if (http_status == MHD_HTTP_RANGE_NOT_SATISFIABLE) {
+    close(fd);
+    MHD_Response * response = MHD_create_response_from_buffer(
+        0, nullptr, MHD_RESPMEM_PERSISTENT);
+    MHD_add_response_header(response, "Content-Range",
+                            ("bytes */" + std::to_string(size)).c_str());
+    auto ret = MHD_queue_response(connection, http_status, response);
+    MHD_destroy_response(response);
+    return ret;
+  }
+
+  // The response owns the fd; file responses go out with sendfile
+  MHD_Response * response = MHD_create_response_from_fd_at_offset64(
+      end - begin, fd, begin);
+  if (response == nullptr) {
+    close(fd);
+    return HandleStatus(connection, MHD_HTTP_INTERNAL_SERVER_ERROR);
+  }
+  MHD_add_response_header(response, "Content-Type", "video/mp4");
+  MHD_add_response_header(response, "Accept-Ranges", "bytes");
+  if (http_status == MHD_HTTP_PARTIAL_CONTENT) {
+    MHD_add_response_header(
+        response, "Content-Range",
+        ("bytes " + std::to_string(begin) + "-" + std::to_string(end - 1) +
+         "/" + std::to_string(size)).c_str());
+  }
+
+  auto ret = MHD_queue_response(connection, http_status, response);
+  MHD_destroy_response(response);
+
+  return ret;
+}
+
+int WebApp::HandleStatus(struct MHD_Connection * connection,
+                         unsigned int status) {
+  MHD_Response * response = MHD_create_response_from_buffer(
+      0, nullptr, MHD_RESPMEM_PERSISTENT);
+
+  auto ret = MHD_queue_response(connection, status, response);
+  MHD_destroy_response(response);
+
+  return ret;
+}
+
+int WebApp::HandleGetSharedBuffer(struct MHD_Connection * connection,
+                                  std::shared_ptr<const void> owner,
+                                  const uint8_t * data, size_t size,
+                                  const std::string & mime_type,
+                                  const std::string & cache_control) {
+  MHD_Response * response = MHD_create_response_from_callback(
+      size, 64 * 1024, HandleSharedBufferCallback,
+      new SharedBuffer{std::move(owner), data, size},
+      FreeSharedBufferCallback);
+  MHD_add_response_header(response, "Content-Type", mime_type.c_str());
+  MHD_add_response_header(response, "Cache-Control", cache_control.c_str());
+
+  auto ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
+  MHD_destroy_response(response);
+
+  return ret;
+}
+
 }  // namespace foscam_hd
@@ -6,6 +6,7 @@
 #include <unordered_set>
 #include <vector>
 
+#include "camera_manager.h"
 #include "foscam.h"
 
 struct MHD_Daemon;
@@ -23,26 +24,48 @@ class WebAppException : public std::exception {
   std::string what_;
 };
 
+// Serves every camera of the manager under /camera/<id>/, and the first one
+// at the top level as well
 class WebApp {
  public:
-  explicit WebApp(std::shared_ptr<Foscam> cam);
+  explicit WebApp(const CameraManager & cameras);
   ~WebApp();
 
  private:
   int HandleConnection(struct MHD_Connection * connection,
                        const char * url, const char * method,
                        const char * version);
+  // path is relative to prefix, the URL the camera is served under
+  int HandleCameraRequest(struct MHD_Connection * connection, Foscam & cam,
+                          const std::string & prefix,
+                          const std::string & path);
   int HandleGetBuffer(struct MHD_Connection * connection,
                       const std::vector<uint8_t> & buffer,
                       const std::string & mime_type);
-  int HandleGetVideoStream(struct MHD_Connection * connection);
+  int HandleGetCameras(struct MHD_Connection * connection);
+  int HandleGetVideoStream(struct MHD_Connection * connection, Foscam & cam,
+                           RemuxSession::Mode mode);
+  int HandleGetHls(struct MHD_Connection * connection, Foscam & cam,
+                   const std::string & name);
+  int HandleGetRecordingSeek(struct MHD_Connection * connection,
+                             Foscam & cam, const std::string & prefix);
+  int HandleGetRecording(struct MHD_Connection * connection, Foscam & cam,
+                         const std::string & name);
+  int HandleStatus(struct MHD_Connection * connection, unsigned int status);
+  // Serves data owned by owner without copying it, for shared buffers that
+  // never change
+  int HandleGetSharedBuffer(struct MHD_Connection * connection,
+                            std::shared_ptr<const void> owner,
+                            const uint8_t * data, size_t size,
+                            const std::string & mime_type,
+                            const std::string & cache_control);
 
   friend int HandleConnectionCallback(
       void * callback_object, MHD_Connection * connection,
       const char * url, const char * method,
       const char * version, const char *, size_t *, void **);
 
-  std::shared_ptr<Foscam> cam_;
+  const CameraManager & cameras_;
   struct MHD_Daemon * http_server_;
   std::vector<uint8_t> favicon_;
   std::vector<uint8_t> video_player_;
@@ -0,0 +1,176 @@
+#include "worker_pool.h"
+
+#include <algorithm>
+#include <iostream>
+
+namespace {
+
+// Set on pool threads so work they schedule goes to their own queue
+thread_local const foscam_hd::WorkerPool * current_pool = nullptr;
+thread_local size_t current_worker = 0;
+
+}  // namespace
+
+namespace foscam_hd {
+
+WorkerPool::Task::Task(WorkerPool & pool, std::function<void()> run)
+    : pool_(pool), run_(std::move(run)), state_(State::IDLE),
+      stopped_(false), notifier_([this]() { Schedule(); }) {
+}
+
+WorkerPool::Task::~Task() {
+  Stop();
+}
+
+void WorkerPool::Task::Schedule() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (stopped_) {
+    return;
+  }
+
+  switch (state_) {
+    case State::IDLE:
+      state_ = State::SCHEDULED;
+      lock.unlock();
+      pool_.Submit(this);
+      break;
+    case State::RUNNING:
+      state_ = State::RESCHEDULED;
+      break;
+    default:
+      break;
+  }
+}
+
+void WorkerPool::Task::Stop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  stopped_ = true;
+  idle_.wait(lock, [this]() { return state_ == State::IDLE; });
+}
+
+Notifier & WorkerPool::Task::notifier() {
+  return notifier_;
+}
+
+void WorkerPool::Task::Run() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopped_) {
+      state_ = State::IDLE;
+      idle_.notify_all();
+      return;
+    }
+    state_ = State::RUNNING;
+  }
+
+  try {
+    run_();
+  } catch (std::exception & ex) {
+    std::cerr << "Failure occured while running pipeline task: " << ex.what()
+              << std::endl;
+  }
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (state_ == State::RESCHEDULED && !stopped_) {
+    state_ = State::SCHEDULED;
+    lock.unlock();
+    pool_.Submit(this);
+    return;
+  }
+  state_ = State::IDLE;
+  idle_.notify_all();
+}
+
+WorkerPool::WorkerPool(size_t thread_count)
+    : next_worker_(0), pending_(0), stopping_(false) {
+  if (thread_count == 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (size_t idx = 0; idx < thread_count; idx++) {
+    workers_.emplace_back(new Worker());
+  }
+  for (size_t idx = 0; idx < thread_count; idx++) {
+    threads_.emplace_back(&WorkerPool::ThreadRun, this, idx);
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    stopping_ = true;
+  }
+  pending_cond_.notify_all();
+
+  for (auto & thread : threads_) {
+    thread.join();
+  }
+}
+
+size_t WorkerPool::thread_count() const {
+  return threads_.size();
+}
+
+void WorkerPool::Submit(Task * task) {
+  size_t worker = current_pool == this ? current_worker :
+      next_worker_.fetch_add(1, std::memory_order_relaxed) % workers_.size();
+  {
+    std::lock_guard<std::mutex> lock(workers_[worker]->mutex);
+    workers_[worker]->tasks.push_back(task);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(pending_mutex_);
+    pending_++;
+  }
+  pending_cond_.notify_one();
+}
+
+auto WorkerPool::Take(size_t worker) -> Task * {
+  // The caller has claimed a pending task, so one is queued somewhere. Own
+  // work is taken in order so a task that yields does not starve the rest of
+  // the queue; thieves take the newest.
+  while (true) {
+    {
+      Worker & own = *workers_[worker];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty()) {
+        Task * task = own.tasks.front();
+        own.tasks.pop_front();
+        return task;
+      }
+    }
+
+    for (size_t offset = 1; offset < workers_.size(); offset++) {
+      Worker & victim = *workers_[(worker + offset) % workers_.size()];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        Task * task = victim.tasks.back();
+        victim.tasks.pop_back();
+        return task;
+      }
+    }
+  }
+}
+
+void WorkerPool::ThreadRun(size_t worker) {
+  current_pool = this;
+  current_worker = worker;
+
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(pending_mutex_);
+      pending_cond_.wait(lock, [this]() {
+        return pending_ > 0 || stopping_;
+      });
+      if (pending_ == 0) {
+        return;
+      }
+      pending_--;
+    }
+
+    Take(worker)->Run();
+  }
+}
+
+}  // namespace foscam_hd
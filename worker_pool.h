@@ -0,0 +1,91 @@
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "notifier.h"
+
+namespace foscam_hd {
+
+// Fixed set of threads running the media pipeline stages. Each worker has
+// its own queue; work scheduled from a worker stays on it, and an idle
+// worker steals from the others, so the thread count does not grow with the
+// number of cameras and viewers.
+class WorkerPool {
+ public:
+  // A unit of work that runs whenever it is scheduled, never concurrently
+  // with itself. Scheduling while it runs makes it run once more.
+  class Task {
+   public:
+    Task(WorkerPool & pool, std::function<void()> run);
+    ~Task();
+
+    void Schedule();
+    // Waits for a scheduled or running call to finish; later schedules do
+    // nothing
+    void Stop();
+
+    // Schedules the task when notified, for the rings it reads from
+    Notifier & notifier();
+
+   private:
+    friend class WorkerPool;
+
+    enum class State {IDLE, SCHEDULED, RUNNING, RESCHEDULED};
+
+    void Run();
+
+    WorkerPool & pool_;
+    std::function<void()> run_;
+    std::mutex mutex_;
+    std::condition_variable idle_;
+    State state_;
+    bool stopped_;
+    Notifier notifier_;
+
+    Task(const Task &) = delete;
+    Task & operator=(const Task &) = delete;
+  };
+
+  // Defaults to one worker per core
+  explicit WorkerPool(size_t thread_count = 0);
+  ~WorkerPool();
+
+  size_t thread_count() const;
+
+ private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<Task *> tasks;
+  };
+
+  void Submit(Task * task);
+  Task * Take(size_t worker);
+  void ThreadRun(size_t worker);
+
+  std::vector<std::unique_ptr<Worker> > workers_;
+  std::atomic<size_t> next_worker_;
+
+  // Queued tasks not yet claimed by a worker
+  std::mutex pending_mutex_;
+  std::condition_variable pending_cond_;
+  size_t pending_;
+  bool stopping_;
+
+  std::vector<std::thread> threads_;
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool & operator=(const WorkerPool &) = delete;
+};
+
+}  // namespace foscam_hd
+
+#endif  // WORKER_POOL_H_